@@ -41,6 +41,10 @@
 
  Publishes to (name/type):
  - @b "/tf"/tf/tfMessage: position relative to the map
+ - @b "map"/nav_msgs/OccupancyGrid: the whole map, sent to each new subscriber and, when map updates are published, only when the rolling window moves or every map_snapshot_interval seconds
+ - @b "map_updates"/map_msgs/OccupancyGridUpdate: in rolling mode, the rectangles of the map changed by a map update, one message each
+ - @b "~tf_jitter"/std_msgs/Float64MultiArray: timing of the map to odom transform published, every tf_jitter_period seconds. The columns are the transforms sent, the mean, standard deviation and maximum of the interval between two of them, in seconds, the largest difference of an interval from transform_publish_period, and the largest age of the pose sent, from the stamp of the scan that produced it.
+ - @b "~map_memory"/std_msgs/Float64MultiArray: memory taken by the maps of the particles, after each map update. One row per particle, then one for all the maps together, where the patches shared by several maps count once. The columns are the patches, the shared patches, the bytes of the patches not shared and the total bytes.
 
 
  @section services
@@ -57,7 +61,13 @@
  - @b "~base_frame": @b [string] the tf frame_id to use for the robot base pose
  - @b "~map_frame": @b [string] the tf frame_id where the robot pose on the map is published
  - @b "~odom_frame": @b [string] the tf frame_id from which odometry is read
- - @b "~map_update_interval": @b [double] time in seconds between two recalculations of the map
+ - @b "~transform_publish_period": @b [double] time in seconds between two publications of the map to odom transform, 0 to not publish it (default: 0.05)
+ - @b "~tf_jitter_period": @b [double] time in seconds over which the timing of the published transform is collected for ~tf_jitter, 0 to not collect it (default: 1.0)
+ - @b "~map_update_interval": @b [double] time in seconds between two recalculations of the map. The map is rendered by a thread of its own while the scans keep being processed; an update posted while the previous one is still pending is merged into it, and how often that happens is logged.
+ - @b "~publish_map_updates": @b [bool] in rolling mode, publish the changes of the map on "map_updates" rather than the whole map on every map update (default: true)
+ - @b "~render_particle_map": @b [bool] in rolling mode, render the map from a copy of the map of the best particle, which shares its patches, rather than by registering the scans of the best trajectory again. Only the patches the particle has written since the previous render are drawn. (default: false)
+ - @b "~map_replay_interval": @b [double] with render_particle_map, time in seconds between two renders that rebuild the map from the whole best trajectory instead, 0 for never (default: 0)
+ - @b "~map_snapshot_interval": @b [double] time in seconds between two publications of the whole map while map updates are published, 0 to send it only when the window moves (default: 30)
 
 
  Parameters used by GMapping itself:
@@ -73,11 +83,17 @@
  - @b "~/lsigma" @b [double] standard deviation for the scan matching process (single laser beam)
  - @b "~/ogain" @b [double] gain for smoothing the likelihood
  - @b "~/lskip" @b [int] take only every (n+1)th laser ray for computing a match (0 = take all rays)
+ - @b "~/likelihoodField" @b [bool] scan match against a likelihood field cached for each particle map instead of searching the kernel around each beam endpoint. Faster, but needs memory for the fields and approximates the kernel search. (default: false)
+ - @b "~/multiResolutionLevels" @b [int] number of coarser levels, each halving the resolution of the previous one, cached for each particle map and matched coarse to fine before the map itself. Widens the convergence basin when the odometry is poor, at the price of memory for the levels; at most the patch magnitude of the map (5). (0 = disabled, default: 0)
+ - @b "~/correlativeMatching" @b [bool] scan match each particle by searching its whole correlative window with branch and bound on coarse levels of its map, then hill climbing, instead of hill climbing only. Recovers from larger odometry drift, where the hill climbing fails and falls back to the odometry, but is slower. Uses the levels of multiResolutionLevels, or 4 if that is 0. (default: false)
+ - @b "~/correlativeLinearWindow" @b [double] half size of the correlative window in translation, in meters (default: 0.5)
+ - @b "~/correlativeAngularWindow" @b [double] half size of the correlative window in rotation, in radians (default: 0.35)
  - @b "~/minimumScore" @b [double] minimum score for considering the outcome of the scanmatching good. Can avoid 'jumping' pose estimates in large open spaces when using laser scanners with limited range (e.g. 5m). (0 = default. Scores go up to 600+, try 50 for example when experiencing 'jumping' estimate issues)
 
  Motion Model Parameters (all standard deviations of a gaussian noise model)
  - @b "~/srr" @b [double] linear noise component (x and y)
  - @b "~/stt" @b [double] angular noise component (theta)
+ - @b "~/motionModelSeed" @b [int] seed of the random generators drawing the odometry noise of the particles (default: 0)
  - @b "~/srt" @b [double] linear -> angular noise component
  - @b "~/str" @b [double] angular -> linear noise component
 
@@ -86,7 +102,14 @@
  - @b "~/angularUpdate" @b [double] the robot only processes new measurements if the robot has turned at least this many rads
 
  - @b "~/resampleThreshold" @b [double] threshold at which the particles get resampled. Higher means more frequent resampling.
+ - @b "~/resampling" @b [string] how the particles are drawn on resampling: "systematic", "stratified" or "residual" (default: systematic)
+ - @b "~/resamplingSeed" @b [int] seed of the random generator drawing the particles on resampling, so that runs over the same data resample alike (default: 0)
  - @b "~/particles" @b [int] (fixed) number of particles. Each particle represents a possible trajectory that the robot has traveled
+ - @b "~/threads" @b [int] number of threads used for scan matching the particles concurrently (0 = one per cpu, default: 1)
+ - @b "~/patchPoolReserve" @b [int] number of map patches allocated up front by the patch pool. The pool statistics are printed at debug level after each map update, use their peak to size it. (default: 0)
+ - @b "~/patchPoolSlab" @b [int] number of map patches the patch pool allocates at once when it runs out of patches (default: 256)
+ - @b "~/quantizeRanges" @b [bool] store the ranges of the scans kept by the trajectory tree as 16 bit integers rather than floats, halving their memory (default: false)
+ - @b "~/rangeResolution" @b [double] resolution of the quantized ranges, in meters. Ranges are kept within half of it, up to 65534 times it. (default: 0.001)
 
  Likelihood sampling (used in scan matching)
  - @b "~/llsamplerange" @b [double] linear range
@@ -102,8 +125,9 @@
  - @b "~/delta" @b [double] size of one pixel [m]
 
  Rolling window:
- - @b "~/rolling" @b [bool] enable rolling window mode or not?
+ - @b "~/rolling" @b [bool] enable rolling window mode or not? In rolling mode the map is kept between the updates, scrolled with the window, and each update registers only the scans added to the best trajectory since the previous one (the whole trajectory when the best particle switches branch).
  - @b "~/windowsize" @b [double] size of the rolling window [m] (will overrule xmin, ymin, xmax, and ymax)
+ - @b "~/mapMemoryBudget" @b [double] memory the maps of the particles may take together, in MB. When a map update finds them above it, the patches out of the rolling window of each particle are evicted, and if that is not enough the window is narrowed, down to twice maxUrange. Only used in rolling mode: without a rolling window the particle maps are never trimmed, and the parameter is ignored with a warning. (0 = no budget, default: 0)
 
  Extra:
  - @b "~/publishCurrentPath" @b [bool] Publish RVIZ visualizable path for current particle. (default: false)
@@ -115,6 +139,8 @@
 
 #include "rw_gmapping.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 #include <time.h>
@@ -130,8 +156,10 @@
 #define MAP_IDX(sx, i, j) ((sx) * (j) + (i))
 
 SlamGMappingRolling::SlamGMappingRolling() :
-    map_to_odom_(tf::Transform(tf::createQuaternionFromRPY(0, 0, 0), tf::Point(0, 0, 0))),
-        laser_count_(0), transform_thread_(NULL)
+    map_to_odom_(tf::Transform(tf::createQuaternionFromRPY(0, 0, 0), tf::Point(0, 0, 0))), map_to_odom_seq_(0),
+        laser_count_(0), transform_thread_(NULL), rolling_map_(NULL), rolling_map_node_(NULL), rolling_map_rebuilt_(false),
+        render_thread_(NULL), render_posted_(false), render_stop_(false), trim_particle_maps_(false),
+        renders_requested_(0), renders_coalesced_(0), renders_done_(0)
 {
   // log4cxx::Logger::getLogger(ROSCONSOLE_DEFAULT_NAME)->setLevel(ros::console::g_level_lookup[ros::console::levels::Debug]);
 
@@ -164,11 +192,22 @@ SlamGMappingRolling::SlamGMappingRolling() :
 
   double transform_publish_period;
   private_nh.param("transform_publish_period", transform_publish_period, 0.05);
+  private_nh.param("tf_jitter_period", tf_jitter_period_, 1.0);
 
   double tmp;
   if (!private_nh.getParam("map_update_interval", tmp))
     tmp = 5.0;
   map_update_interval_.fromSec(tmp);
+  if (!private_nh.getParam("publish_map_updates", publish_map_updates_))
+    publish_map_updates_ = true;
+  if (!private_nh.getParam("render_particle_map", render_particle_map_))
+    render_particle_map_ = false;
+  if (!private_nh.getParam("map_replay_interval", tmp))
+    tmp = 0.0;
+  map_replay_interval_.fromSec(tmp);
+  if (!private_nh.getParam("map_snapshot_interval", tmp))
+    tmp = 30.0;
+  map_snapshot_interval_.fromSec(tmp);
 
   // Parameters used by GMapping itself
   maxUrange_ = 0.0;
@@ -187,6 +226,16 @@ SlamGMappingRolling::SlamGMappingRolling() :
     lsigma_ = 0.075;
   if (!private_nh.getParam("ogain", ogain_))
     ogain_ = 3.0;
+  if (!private_nh.getParam("likelihoodField", likelihood_field_))
+    likelihood_field_ = false;
+  if (!private_nh.getParam("multiResolutionLevels", multi_resolution_levels_))
+    multi_resolution_levels_ = 0;
+  if (!private_nh.getParam("correlativeMatching", correlative_matching_))
+    correlative_matching_ = false;
+  if (!private_nh.getParam("correlativeLinearWindow", correlative_linear_window_))
+    correlative_linear_window_ = 0.5;
+  if (!private_nh.getParam("correlativeAngularWindow", correlative_angular_window_))
+    correlative_angular_window_ = 0.35;
   if (!private_nh.getParam("lskip", lskip_))
     lskip_ = 0;
   if (!private_nh.getParam("srr", srr_))
@@ -205,8 +254,24 @@ SlamGMappingRolling::SlamGMappingRolling() :
     temporalUpdate_ = -1.0;
   if (!private_nh.getParam("resampleThreshold", resampleThreshold_))
     resampleThreshold_ = 0.5;
+  if (!private_nh.getParam("motionModelSeed", motion_model_seed_))
+    motion_model_seed_ = 0;
+  if (!private_nh.getParam("resampling", resampling_))
+    resampling_ = "systematic";
+  if (!private_nh.getParam("resamplingSeed", resampling_seed_))
+    resampling_seed_ = 0;
   if (!private_nh.getParam("particles", particles_))
     particles_ = 30;
+  if (!private_nh.getParam("threads", threads_))
+    threads_ = 1;
+  if (!private_nh.getParam("quantizeRanges", quantize_ranges_))
+    quantize_ranges_ = false;
+  if (!private_nh.getParam("rangeResolution", range_resolution_))
+    range_resolution_ = 0.001;
+  if (!private_nh.getParam("patchPoolReserve", patch_pool_reserve_))
+    patch_pool_reserve_ = 0;
+  if (!private_nh.getParam("patchPoolSlab", patch_pool_slab_))
+    patch_pool_slab_ = 256;
   if (!private_nh.getParam("xmin", xmin_))
     xmin_ = -100.0;
   if (!private_nh.getParam("ymin", ymin_))
@@ -244,6 +309,14 @@ SlamGMappingRolling::SlamGMappingRolling() :
     ymax_ = windowsize_ / 2.0;
   }
 
+  if (!private_nh.getParam("mapMemoryBudget", map_memory_budget_))
+    map_memory_budget_ = 0.0;
+  else if (map_memory_budget_ > 0 && !rolling_) {
+    // without a rolling window the particle maps are the whole map the filter matches against
+    ROS_WARN("~mapMemoryBudget only applies in rolling mode, ignoring it");
+    map_memory_budget_ = 0.0;
+  }
+
   if (!private_nh.getParam("tf_delay", tf_delay_))
     tf_delay_ = transform_publish_period;
 
@@ -269,8 +342,12 @@ SlamGMappingRolling::SlamGMappingRolling() :
   }
 
   entropy_publisher_ = private_nh.advertise<std_msgs::Float64>("entropy", 1, true);
-  sst_ = node_.advertise<nav_msgs::OccupancyGrid>("map", 1, true);
+  sst_ = node_.advertise<nav_msgs::OccupancyGrid>("map", 1, boost::bind(&SlamGMappingRolling::mapSubscribed, this, _1),
+                                                   ros::SubscriberStatusCallback(), ros::VoidConstPtr(), true);
+  map_updates_publisher_ = node_.advertise<map_msgs::OccupancyGridUpdate>("map_updates", 10);
   sstm_ = node_.advertise<nav_msgs::MapMetaData>("map_metadata", 1, true);
+  map_memory_publisher_ = private_nh.advertise<std_msgs::Float64MultiArray>("map_memory", 1, true);
+  tf_jitter_publisher_ = private_nh.advertise<std_msgs::Float64MultiArray>("tf_jitter", 1);
 
   // KL Visualize and store all paths / maps
   if (publish_all_paths_) {
@@ -306,6 +383,7 @@ SlamGMappingRolling::SlamGMappingRolling() :
   scan_filter_->registerCallback(boost::bind(&SlamGMappingRolling::laserCallback, this, _1));
 
   transform_thread_ = new boost::thread(boost::bind(&SlamGMappingRolling::publishLoop, this, transform_publish_period));
+  render_thread_ = new boost::thread(boost::bind(&SlamGMappingRolling::renderLoop, this));
 }
 
 void SlamGMappingRolling::publishLoop(double transform_publish_period)
@@ -314,19 +392,100 @@ void SlamGMappingRolling::publishLoop(double transform_publish_period)
     return;
 
   ros::Rate r(1.0 / transform_publish_period);
+  TransformTiming timing;
+  ros::WallTime window_start = ros::WallTime::now();
   while (ros::ok()) {
-    publishTransform();
+    ros::Time stamp = publishTransform();
+    if (tf_jitter_period_ > 0) {
+      timing.add(ros::WallTime::now(), stamp, transform_publish_period);
+      if ((ros::WallTime::now() - window_start).toSec() >= tf_jitter_period_) {
+        publishTransformTiming(timing);
+        timing = TransformTiming();
+        window_start = ros::WallTime::now();
+      }
+    }
     r.sleep();
   }
 }
 
+void SlamGMappingRolling::TransformTiming::add(const ros::WallTime& now, const ros::Time& stamp, double period)
+{
+  if (!last.isZero()) {
+    double interval = (now - last).toSec();
+    intervals++;
+    sum += interval;
+    sum2 += interval * interval;
+    max_interval = std::max(max_interval, interval);
+    max_jitter = std::max(max_jitter, fabs(interval - period));
+  }
+  if (!stamp.isZero())
+    max_age = std::max(max_age, (ros::Time::now() - stamp).toSec());
+  last = now;
+  sent++;
+}
+
+void SlamGMappingRolling::publishTransformTiming(const TransformTiming& timing)
+{
+  double mean = timing.intervals ? timing.sum / timing.intervals : 0.0;
+  double deviation = timing.intervals ? sqrt(std::max(0.0, timing.sum2 / timing.intervals - mean * mean)) : 0.0;
+  ROS_DEBUG("map to odom: %u transforms sent, interval %.4f +- %.4f s (max %.4f), jitter up to %.4f s, pose up to %.3f s old",
+            timing.sent, mean, deviation, timing.max_interval, timing.max_jitter, timing.max_age);
+
+  std_msgs::Float64MultiArray jitter;
+  jitter.layout.dim.resize(1);
+  jitter.layout.dim[0].label = "sent,mean_interval,stddev_interval,max_interval,max_jitter,max_age";
+  jitter.layout.dim[0].size = 6;
+  jitter.layout.dim[0].stride = 6;
+  jitter.data.push_back(timing.sent);
+  jitter.data.push_back(mean);
+  jitter.data.push_back(deviation);
+  jitter.data.push_back(timing.max_interval);
+  jitter.data.push_back(timing.max_jitter);
+  jitter.data.push_back(timing.max_age);
+  tf_jitter_publisher_.publish(jitter);
+}
+
+void SlamGMappingRolling::setMapToOdom(const tf::Transform& map_to_odom, const ros::Time& stamp)
+{
+  // seqlock: the sequence is odd while the transform is written, only the SLAM thread writes it
+  __sync_fetch_and_add(&map_to_odom_seq_, 1);
+  map_to_odom_ = map_to_odom;
+  map_to_odom_stamp_ = stamp;
+  __sync_fetch_and_add(&map_to_odom_seq_, 1);
+}
+
+tf::Transform SlamGMappingRolling::getMapToOdom(ros::Time& stamp) const
+{
+  // the copy is retried if the transform was being written, or has been written meanwhile
+  tf::Transform map_to_odom;
+  unsigned int seq;
+  do {
+    while ((seq = map_to_odom_seq_) & 1)
+      ;
+    __sync_synchronize();
+    map_to_odom = map_to_odom_;
+    stamp = map_to_odom_stamp_;
+    __sync_synchronize();
+  } while (seq != map_to_odom_seq_);
+  return map_to_odom;
+}
+
 SlamGMappingRolling::~SlamGMappingRolling()
 {
   if (transform_thread_) {
     transform_thread_->join();
     delete transform_thread_;
   }
+  if (render_thread_) {
+    render_mutex_.lock();
+    render_stop_ = true;
+    render_cond_.notify_all();
+    render_mutex_.unlock();
+    render_thread_->join();
+    delete render_thread_;
+  }
 
+  delete rolling_map_;
   delete gsp_;
   if (gsp_laser_)
     delete gsp_laser_;
@@ -411,6 +570,7 @@ SlamGMappingRolling::initMapper(const sensor_msgs::LaserScan& scan)
   }
 
   gsp_laser_beam_count_ = scan.ranges.size();
+  replay_ranges_.resize(gsp_laser_beam_count_);
 
   int orientationFactor;
   if (up.z() > 0)
@@ -473,7 +633,18 @@ SlamGMappingRolling::initMapper(const sensor_msgs::LaserScan& scan)
       ogain_, lskip_);
 
   gsp_->setMotionModelParameters(srr_, srt_, str_, stt_);
+  gsp_->setMotionModelSeed(motion_model_seed_ < 0 ? 0 : motion_model_seed_);
   gsp_->setUpdateDistances(linearUpdate_, angularUpdate_, resampleThreshold_);
+  ResamplingScheme resampling_scheme = SystematicResampling;
+  if (resampling_ == "stratified")
+    resampling_scheme = StratifiedResampling;
+  else if (resampling_ == "residual")
+    resampling_scheme = ResidualResampling;
+  else if (resampling_ != "systematic")
+    ROS_WARN("Unknown resampling \"%s\", using systematic resampling", resampling_.c_str());
+  gsp_->setResamplingParameters(resampling_scheme, resampling_seed_ < 0 ? 0 : resampling_seed_);
+  gsp_->setReadingEncoding(quantize_ranges_ ? GMapping::RangeBuffer::Quantized : GMapping::RangeBuffer::Float,
+      range_resolution_);
 //  gsp_->setUpdatePeriod(temporalUpdate_);
   gsp_->setgenerateMap(false);
 
@@ -488,6 +659,16 @@ SlamGMappingRolling::initMapper(const sensor_msgs::LaserScan& scan)
   gsp_->setlasamplerange(lasamplerange_);
   gsp_->setlasamplestep(lasamplestep_);
   gsp_->setminimumScore(minimum_score_);
+  gsp_->setthreads(threads_ < 0 ? 1 : threads_);
+  gsp_->setuseLikelihoodField(likelihood_field_);
+  gsp_->setmultiResolutionLevels(multi_resolution_levels_ < 0 ? 0 : multi_resolution_levels_);
+  gsp_->setcorrelativeLinearWindow(correlative_linear_window_);
+  gsp_->setcorrelativeAngularWindow(correlative_angular_window_);
+  gsp_->setuseCorrelativeMatching(correlative_matching_);
+  GMapping::PatchPool<GMapping::ScanMatcherCell>& patch_pool = GMapping::PatchPool<GMapping::ScanMatcherCell>::instance();
+  patch_pool.setPatchesPerSlab(patch_pool_slab_ < 1 ? 1 : patch_pool_slab_);
+  if (patch_pool_reserve_ > 0)
+    patch_pool.reserve(patch_pool_reserve_);
 
   // Call the sampling function once to set the seed.
   GMapping::sampleGaussian(1, time(NULL));
@@ -505,45 +686,25 @@ bool SlamGMappingRolling::addScan(const sensor_msgs::LaserScan& scan, GMapping::
   if (scan.ranges.size() != gsp_laser_beam_count_)
     return false;
 
-  // GMapping wants an array of doubles...
-  double* ranges_double = new double[scan.ranges.size()];
+  // the ranges are encoded once, straight from the message, into the buffer the trajectory tree keeps;
+  // the scan matcher decodes them into a scratch array that it reuses from one scan to the next
+  unsigned int num_ranges = scan.ranges.size();
+  GMapping::RangeBuffer* ranges = new GMapping::RangeBuffer(num_ranges, gsp_->getReadingEncoding(), gsp_->getReadingResolution());
+  GMapping::RangeBufferPtr reading(ranges);
   // If the angle increment is negative, we have to invert the order of the readings.
-  if (gsp_laser_angle_increment_ < 0)
-      {
+  bool inverted = gsp_laser_angle_increment_ < 0;
+  if (inverted)
     ROS_DEBUG("Inverting scan");
-    int num_ranges = scan.ranges.size();
-    for (int i = 0; i < num_ranges; i++)
-        {
-      // Must filter out short readings, because the mapper won't
-      if (scan.ranges[i] < scan.range_min)
-        ranges_double[i] = (double) scan.range_max;
-      else
-        ranges_double[i] = (double) scan.ranges[num_ranges - i - 1];
-    }
-  }
-  else
-  {
-    for (unsigned int i = 0; i < scan.ranges.size(); i++)
-        {
-      // Must filter out short readings, because the mapper won't
-      if (scan.ranges[i] < scan.range_min)
-        ranges_double[i] = (double) scan.range_max;
-      else
-        ranges_double[i] = (double) scan.ranges[i];
-    }
+  for (unsigned int i = 0; i < num_ranges; i++)
+      {
+    float range = inverted ? scan.ranges[num_ranges - i - 1] : scan.ranges[i];
+    // Must filter out short readings, because the mapper won't
+    if (range < scan.range_min)
+      ranges->set(i, scan.range_max);
+    else
+      ranges->set(i, range);
   }
 
-  GMapping::RangeReading reading(scan.ranges.size(),
-      ranges_double,
-      gsp_laser_,
-      scan.header.stamp.toSec());
-
-  // ...but it deep copies them in RangeReading constructor, so we don't
-  // need to keep our array around.
-  delete[] ranges_double;
-
-  reading.setPose(gmap_pose);
-
   /*
    ROS_DEBUG("scanpose (%.3f): %.3f %.3f %.3f\n",
    scan.header.stamp.toSec(),
@@ -552,7 +713,7 @@ bool SlamGMappingRolling::addScan(const sensor_msgs::LaserScan& scan, GMapping::
    gmap_pose.theta);
    */
 
-  return gsp_->processScan(reading);
+  return gsp_->processScan(reading, gmap_pose, scan.header.stamp.toSec());
 }
 
 void
@@ -581,19 +742,36 @@ SlamGMappingRolling::laserCallback(const sensor_msgs::LaserScan::ConstPtr& scan)
     ROS_DEBUG("new best pose: %.3f %.3f %.3f", mpose.x, mpose.y, mpose.theta);
     ROS_DEBUG("odom pose: %.3f %.3f %.3f", odom_pose.x, odom_pose.y, odom_pose.theta);
     ROS_DEBUG("correction: %.3f %.3f %.3f", mpose.x - odom_pose.x, mpose.y - odom_pose.y, mpose.theta - odom_pose.theta);
+    if (gsp_->getresampleCopyBytes())
+      ROS_DEBUG("resampling copied %lu bytes of particles", gsp_->getresampleCopyBytes());
 
     tf::Transform laser_to_map = tf::Transform(tf::createQuaternionFromRPY(0, 0, mpose.theta), tf::Vector3(mpose.x, mpose.y, 0.0)).inverse();
     tf::Transform odom_to_laser = tf::Transform(tf::createQuaternionFromRPY(0, 0, odom_pose.theta), tf::Vector3(odom_pose.x, odom_pose.y, 0.0));
 
-    map_to_odom_mutex_.lock();
-    map_to_odom_ = (odom_to_laser * laser_to_map).inverse();
-    map_to_odom_mutex_.unlock();
+    setMapToOdom((odom_to_laser * laser_to_map).inverse(), scan->header.stamp);
+
+    // the window of the rendered map has moved, the particle maps follow
+    render_mutex_.lock();
+    bool trim = trim_particle_maps_;
+    trim_particle_maps_ = false;
+    render_mutex_.unlock();
+    if (trim)
+      trimParticleMaps(windowsize_);
 
-    if (!got_map_ || (scan->header.stamp - last_map_update) > map_update_interval_)
+    if (renders_requested_ == 0 || (scan->header.stamp - last_map_update) > map_update_interval_)
         {
-      updateMap(*scan);
+      postMapRender(scan);
       last_map_update = scan->header.stamp;
-      ROS_DEBUG("Updated the map");
+      ROS_DEBUG("Posted a map update");
+
+      accountMapMemory();
+
+      GMapping::SlabAllocator::Statistics pool = GMapping::PatchPool<GMapping::ScanMatcherCell>::instance().statistics();
+      ROS_DEBUG("patch pool: %u/%u patches in use (peak %u) in %u slabs, %.1f MB, %lu of %lu allocations recycled",
+                pool.used, pool.capacity, pool.peak, pool.slabs, pool.bytes() / 1048576.0, pool.recycled, pool.allocations);
+      GMapping::SlabAllocator::Statistics nodes = GMapping::GridSlamProcessor::TNode::poolStatistics();
+      ROS_DEBUG("trajectory tree: %u/%u nodes in use (peak %u) in %u slabs, %.1f MB",
+                nodes.used, nodes.capacity, nodes.peak, nodes.slabs, nodes.bytes() / 1048576.0);
     }
   }
 }
@@ -601,28 +779,136 @@ SlamGMappingRolling::laserCallback(const sensor_msgs::LaserScan::ConstPtr& scan)
 double
 SlamGMappingRolling::computePoseEntropy()
 {
-  double weight_total = 0.0;
-  for (std::vector<GMapping::GridSlamProcessor::Particle>::const_iterator it = gsp_->getParticles().begin();
-      it != gsp_->getParticles().end();
-      ++it)
-      {
-    weight_total += it->weight;
+  //the entropy of the normalized weights comes with the normalization of the filter
+  return gsp_->getposeEntropy();
+}
+
+//KL: postMapRender is only run every map_update_interval_ seconds.
+void SlamGMappingRolling::postMapRender(const sensor_msgs::LaserScan::ConstPtr& scan)
+{
+  // collect the nodes of the best trajectory added since the last render was posted. If the last posted node is not
+  // an ancestor of the best particle anymore, the best trajectory has switched branch and the map is rebuilt from it.
+  // In the original mode, and for the replays of render_particle_map, the map is always rebuilt from the whole trajectory.
+  const GMapping::GridSlamProcessor::Particle& best = gsp_->getParticles()[gsp_->getBestParticleIndex()];
+  MapRender render;
+  render.scan = scan;
+  render.best_pose = best.pose;
+  bool replay = !rolling_;
+  if (rolling_ && render_particle_map_) {
+    replay = map_replay_interval_ > ros::Duration(0) && scan->header.stamp - last_map_replay_ > map_replay_interval_;
+    if (replay)
+      last_map_replay_ = scan->header.stamp;
+    else
+      render.map.reset(new GMapping::ScanMatcherMap(best.map)); //shares the patches, the particle copies the ones it writes next
   }
-  double entropy = 0.0;
-  for (std::vector<GMapping::GridSlamProcessor::Particle>::const_iterator it = gsp_->getParticles().begin();
-      it != gsp_->getParticles().end();
-      ++it)
+  GMapping::GridSlamProcessor::TNode* n = best.node;
+  for (; n; n = n->parent) {
+    if (!replay && n == rolling_map_node_ && n->reading.m_reference == rolling_map_reading_.m_reference)
+      break;
+    render.poses.push_back(n->pose);
+    render.readings.push_back(n->reading);
+  }
+  render.rebuild = !n;
+  std::reverse(render.poses.begin(), render.poses.end());
+  std::reverse(render.readings.begin(), render.readings.end());
+  rolling_map_node_ = best.node;
+  rolling_map_reading_ = best.node ? best.node->reading : GMapping::RangeBufferPtr();
+
+  {
+    // a render still pending takes the new nodes, unless it is replaced by a rebuild
+    boost::mutex::scoped_lock render_lock(render_mutex_);
+    renders_requested_++;
+    if (render_posted_ && !render.rebuild) {
+      render_pending_.poses.insert(render_pending_.poses.end(), render.poses.begin(), render.poses.end());
+      render_pending_.readings.insert(render_pending_.readings.end(), render.readings.begin(), render.readings.end());
+      render_pending_.scan = render.scan;
+      render_pending_.best_pose = render.best_pose;
+      if (render_pending_.map)
+        render_pending_.map = render.map;
+    }
+    else
+      render_pending_ = render;
+    if (render_posted_) {
+      renders_coalesced_++;
+      ROS_WARN_THROTTLE(10.0, "map rendering is falling behind: %lu of %lu map updates coalesced with a pending one",
+                        renders_coalesced_, renders_requested_);
+    }
+    render_posted_ = true;
+    render_cond_.notify_one();
+  }
+
+  // the rest reads the particles, which belong to this thread
+  std_msgs::Float64 entropy;
+  entropy.data = computePoseEntropy();
+  if (entropy.data > 0.0)
+    entropy_publisher_.publish(entropy);
+
+// KL Visualize and store all paths / maps
+  ROS_DEBUG("Best particle is %d", gsp_->getBestParticleIndex());
+  if (publish_all_paths_ || publish_current_path_) {
+    updateAllPaths();
+    if (publish_all_paths_) {
+      publishAllPaths();
+    }
+    if (publish_current_path_) {
+      publishCurrentPath();
+    }
+  }
+  if (publish_specific_map_ >= 0) {
+    publishMapPX();
+  }
+}
+
+void SlamGMappingRolling::renderLoop()
+{
+  while (true) {
+    MapRender render;
+    {
+      boost::mutex::scoped_lock render_lock(render_mutex_);
+      while (!render_posted_ && !render_stop_)
+        render_cond_.wait(render_lock);
+      if (render_stop_)
+        return;
+      std::swap(render, render_pending_);
+      render_posted_ = false;
+    }
+
+    ros::WallTime start = ros::WallTime::now();
+    updateMap(render);
+
+    boost::mutex::scoped_lock render_lock(render_mutex_);
+    renders_done_++;
+    ROS_DEBUG("Updated the map from %lu nodes in %.3f s; %lu renders for %lu map updates, %lu coalesced",
+              render.poses.size(), (ros::WallTime::now() - start).toSec(), renders_done_, renders_requested_, renders_coalesced_);
+  }
+}
+
+void SlamGMappingRolling::setupRenderMatcher(GMapping::ScanMatcher& matcher, const sensor_msgs::LaserScan& scan)
+{
+  double* laser_angles = new double[scan.ranges.size()];
+  double theta = angle_min_;
+  for (unsigned int i = 0; i < scan.ranges.size(); i++)
       {
-    if (it->weight / weight_total > 0.0)
-      entropy += it->weight / weight_total * log(it->weight / weight_total);
+    if (gsp_laser_angle_increment_ < 0)
+      laser_angles[scan.ranges.size() - i - 1] = theta;
+    else
+      laser_angles[i] = theta;
+    theta += gsp_laser_angle_increment_;
   }
-  return -entropy;
+
+  matcher.setLaserParameters(scan.ranges.size(), laser_angles,
+      gsp_laser_->getPose());
+
+  delete[] laser_angles;
+  matcher.setlaserMaxRange(maxRange_);
+  matcher.setusableRange(maxUrange_);
+  matcher.setgenerateMap(true);
 }
 
-//KL: udpateMap is only run every map_update_interval_ seconds.
-void SlamGMappingRolling::updateMap(const sensor_msgs::LaserScan& scan) {
+//KL: the map is updated by render_thread_, on the trajectories posted by postMapRender.
+void SlamGMappingRolling::updateMap(const MapRender& render) {
   if (rolling_ == false) {
-    updateMapOrig(scan);
+    updateMapOrig(render);
     return;
   }
 
@@ -639,28 +925,51 @@ void SlamGMappingRolling::updateMap(const sensor_msgs::LaserScan& scan) {
     map_.map.info.origin.orientation.w = 1.0;
   }
 
-  GMapping::Point center;
-  center.x = (xmin_ + xmax_) / 2.0;
-  center.y = (ymin_ + ymax_) / 2.0;
-  GMapping::ScanMatcherMap smap(center, xmin_, ymin_, xmax_, ymax_, delta_);
-  // unfortunately, resize gives slightly larger sizes than the constructor, by resizing now we never have to resize the map msg.
-  smap.resize(xmin_, ymin_, xmax_, ymax_); //fixme - p3 - this is caused by a difference in how smap constructor and .resize size. I could patch this in openslam_gmapping instead, which would be nicer...
-
-  //ROS_INFO("smap.isInside(0.0,0.0) = %s",smap.isInside(0.0,0.0) ? "true":"false");
-  //ROS_INFO("(before update) smap size (x,y)=(%d,%d)", smap.getMapSizeX(), smap.getMapSizeY());
-  bool scan_out_of_smap;
-  int tmp_size_x = smap.getMapSizeX();
-  int tmp_size_y = smap.getMapSizeY();
-  updateMapRollingMode(scan, smap, scan_out_of_smap);
-  //ROS_INFO("(after update) smap size (x,y)=(%d,%d)", smap.getMapSizeX(), smap.getMapSizeY());
-  if (tmp_size_x != smap.getMapSizeX() || tmp_size_y != smap.getMapSizeY()) { //fixme - p3 - the matcher also resizes smaps if TNodes are outside of the window, so resizing only if new scan is outside window does only work in the start, then it turns into a semi-continuous updating rolling window
-    resizeAllSMaps(smap, true);
-    //ROS_INFO("(after resize) smap size (x,y)=(%d,%d)", smap.getMapSizeX(), smap.getMapSizeY());
+  GMapping::ScanMatcherMap* rendered;
+  GMapping::HierarchicalArray2D<GMapping::ScanMatcherCell>::PointList dirty;
+  bool full;
+  if (render.map) {
+    // the copy of the map of the best particle
+    full = !changedPatches(*render.map, dirty);
+    followParticleMap(render);
+    particle_map_rendered_ = render.map;
+    rendered = render.map.get();
   }
-  /*if (scan_out_of_smap) { //issue: smap gets actually also resized by other TNodes outside the window, this will mess up map msg if you do not resize. If you do resize, the map msg gets really big
-   resizeAllSMaps(smap, true);
-   ROS_INFO("(after resize) smap size (x,y)=(%d,%d)", smap.getMapSizeX(), smap.getMapSizeY());
-   }*/
+  else {
+    // the map is kept between the updates, which only register the scans of the best trajectory added since the last one
+    if (!rolling_map_) {
+      GMapping::Point center;
+      center.x = (xmin_ + xmax_) / 2.0;
+      center.y = (ymin_ + ymax_) / 2.0;
+      rolling_map_ = new GMapping::ScanMatcherMap(center, xmin_, ymin_, xmax_, ymax_, delta_);
+      // unfortunately, resize gives slightly larger sizes than the constructor, by resizing now we never have to resize the map msg.
+      rolling_map_->resize(xmin_, ymin_, xmax_, ymax_); //fixme - p3 - this is caused by a difference in how smap constructor and .resize size. I could patch this in openslam_gmapping instead, which would be nicer...
+      rolling_map_->storage().setTrackDirtyArea(true);
+    }
+    GMapping::ScanMatcherMap& smap = *rolling_map_;
+
+    //ROS_INFO("smap.isInside(0.0,0.0) = %s",smap.isInside(0.0,0.0) ? "true":"false");
+    //ROS_INFO("(before update) smap size (x,y)=(%d,%d)", smap.getMapSizeX(), smap.getMapSizeY());
+    bool scan_out_of_smap;
+    int tmp_size_x = smap.getMapSizeX();
+    int tmp_size_y = smap.getMapSizeY();
+    updateMapRollingMode(render, smap, scan_out_of_smap);
+    //ROS_INFO("(after update) smap size (x,y)=(%d,%d)", smap.getMapSizeX(), smap.getMapSizeY());
+    if (tmp_size_x != smap.getMapSizeX() || tmp_size_y != smap.getMapSizeY()) { //fixme - p3 - the matcher also resizes smaps if TNodes are outside of the window, so resizing only if new scan is outside window does only work in the start, then it turns into a semi-continuous updating rolling window
+      resizeAllSMaps(smap, render.best_pose, true);
+      //ROS_INFO("(after resize) smap size (x,y)=(%d,%d)", smap.getMapSizeX(), smap.getMapSizeY());
+    }
+    /*if (scan_out_of_smap) { //issue: smap gets actually also resized by other TNodes outside the window, this will mess up map msg if you do not resize. If you do resize, the map msg gets really big
+     resizeAllSMaps(smap, render.best_pose, true);
+     ROS_INFO("(after resize) smap size (x,y)=(%d,%d)", smap.getMapSizeX(), smap.getMapSizeY());
+     }*/
+    smap.storage().takeDirtyArea(dirty);
+    full = rolling_map_rebuilt_ || particle_map_rendered_;
+    rolling_map_rebuilt_ = false;
+    particle_map_rendered_.reset();
+    rendered = rolling_map_;
+  }
+  GMapping::ScanMatcherMap& smap = *rendered;
 
   if (map_.map.info.height == 0) {
     map_.map.info.width = smap.getMapSizeX();
@@ -668,135 +977,165 @@ void SlamGMappingRolling::updateMap(const sensor_msgs::LaserScan& scan) {
     map_.map.data.resize(map_.map.info.width * map_.map.info.height);
   }
 
+  // only the patches written since the last update are rendered again, unless the window has moved or resized
+  GMapping::Point origin = smap.map2world(GMapping::IntPoint(0, 0));
+  full = full || !got_map_ || map_.map.info.width != (unsigned int) smap.getMapSizeX() || map_.map.info.height != (unsigned int) smap.getMapSizeY()
+      || map_.map.info.origin.position.x != origin.x || map_.map.info.origin.position.y != origin.y;
+
   // resize, as sometimes even after running 'resizeAllSmaps', the smap size changes compared to previous.
   resizeMapMsg(smap); //KL, ideally for rolling window Map Msg should never need resize!
-  map_.map.info.origin.position.x = smap.map2world(GMapping::IntPoint(0, 0)).x;
-  map_.map.info.origin.position.y = smap.map2world(GMapping::IntPoint(0, 0)).y;
+  map_.map.info.origin.position.x = origin.x;
+  map_.map.info.origin.position.y = origin.y;
 
-  for (int x = 0; x < smap.getMapSizeX(); x++)
-      {
-    for (int y = 0; y < smap.getMapSizeY(); y++)
-        {
-      /// @todo Sort out the unknown vs. free vs. obstacle thresholding
-      GMapping::IntPoint p(x, y);
-      double occ = smap.cell(p);
-      assert(occ <= 1.0);
-
-      if (occ < 0)
-        map_.map.data[MAP_IDX(map_.map.info.width, x, y)] = -1;
-      else if (occ > occ_thresh_)
-          {
-        //map_.map.data[MAP_IDX(map_.map.info.width, x, y)] = (int)round(occ*100.0);
-        map_.map.data[MAP_IDX(map_.map.info.width, x, y)] = 100;
-      }
-      else
-        map_.map.data[MAP_IDX(map_.map.info.width, x, y)] = 0;
-    }
+  if (full) {
+    renderMap(smap, map_.map, 0, 0, smap.getMapSizeX(), smap.getMapSizeY());
+  } else {
+    int patch = 1 << smap.storage().getPatchMagnitude();
+    for (unsigned int i = 0; i < dirty.size(); i++)
+      renderMap(smap, map_.map, dirty[i].x * patch, dirty[i].y * patch,
+                std::min((dirty[i].x + 1) * patch, smap.getMapSizeX()), std::min((dirty[i].y + 1) * patch, smap.getMapSizeY()));
   }
+  ROS_DEBUG("rendered %s map, %lu patches written since the last update", full ? "the whole" : "the written patches of the", dirty.size());
   got_map_ = true;
 
 //make sure to set the header information on the map
   map_.map.header.stamp = ros::Time::now();
   map_.map.header.frame_id = tf_.resolve(map_frame_);
 
-  sst_.publish(map_.map);
-  sstm_.publish(map_.map.info);
-
-// KL Visualize and store all paths / maps
-  ROS_INFO("Best particle is %d", gsp_->getBestParticleIndex());
-  if (publish_all_paths_ || publish_current_path_) {
-    updateAllPaths();
-    if (publish_all_paths_) {
-      publishAllPaths();
-    }
-    if (publish_current_path_) {
-      publishCurrentPath();
-    }
-  }
-  if (publish_specific_map_ >= 0) {
-    publishMapPX();
+  // the whole map goes out when the updates cannot describe the change, or once in a while for the subscribers that missed some
+  if (full || !publish_map_updates_ || (map_snapshot_interval_ > ros::Duration(0) && map_.map.header.stamp - last_map_snapshot_ > map_snapshot_interval_)) {
+    sst_.publish(map_.map);
+    last_map_snapshot_ = map_.map.header.stamp;
   }
-
+  else
+    publishMapUpdates(dirty, 1 << smap.storage().getPatchMagnitude());
+  sstm_.publish(map_.map.info);
 }
 
-void SlamGMappingRolling::updateMapRollingMode(const sensor_msgs::LaserScan& scan, GMapping::ScanMatcherMap& smap, bool& scan_out_of_smap) {
+void SlamGMappingRolling::updateMapRollingMode(const MapRender& render, GMapping::ScanMatcherMap& smap, bool& scan_out_of_smap) {
   // for checking scan_out_of_smap
   int tmp_size_x = smap.getMapSizeX();
   int tmp_size_y = smap.getMapSizeY();
   scan_out_of_smap = false;
 
   GMapping::ScanMatcher matcher;
-  double* laser_angles = new double[scan.ranges.size()];
-  double theta = angle_min_;
-  for (unsigned int i = 0; i < scan.ranges.size(); i++)
-      {
-    if (gsp_laser_angle_increment_ < 0)
-      laser_angles[scan.ranges.size() - i - 1] = theta;
-    else
-      laser_angles[i] = theta;
-    theta += gsp_laser_angle_increment_;
+  setupRenderMatcher(matcher, *render.scan);
+
+  if (render.rebuild) {
+    ROS_DEBUG("Best trajectory changed branch, rebuilding the map from %lu nodes", render.poses.size());
+    GMapping::Point center;
+    center.x = (xmin_ + xmax_) / 2.0;
+    center.y = (ymin_ + ymax_) / 2.0;
+    smap = GMapping::ScanMatcherMap(center, xmin_, ymin_, xmax_, ymax_, delta_);
+    smap.resize(xmin_, ymin_, xmax_, ymax_);
+    smap.storage().setTrackDirtyArea(true);
+    rolling_map_rebuilt_ = true; //rendered again as a whole
+    rolling_map_poses_.clear();
+    rolling_map_readings_.clear();
   }
 
-  matcher.setLaserParameters(scan.ranges.size(), laser_angles,
-      gsp_laser_->getPose());
-
-  delete[] laser_angles;
-  matcher.setlaserMaxRange(maxRange_);
-  matcher.setusableRange(maxUrange_);
-  matcher.setgenerateMap(true);
-
-  GMapping::GridSlamProcessor::Particle best =
-      gsp_->getParticles()[gsp_->getBestParticleIndex()];
-  std_msgs::Float64 entropy;
-  entropy.data = computePoseEntropy();
-  if (entropy.data > 0.0)
-    entropy_publisher_.publish(entropy);
-
+  // the nodes are registered in the order they were added
   ROS_DEBUG("Trajectory tree:");
-  for (GMapping::GridSlamProcessor::TNode* n = best.node; n; n = n->parent) {
-    ROS_DEBUG("  %.3f %.3f %.3f",
-        n->pose.x,
-        n->pose.y,
-        n->pose.theta);
-    if (!n->reading) {
+  for (unsigned int i = 0; i < render.poses.size(); i++) {
+    const GMapping::OrientedPoint& pose = render.poses[i];
+    ROS_DEBUG("  %.3f %.3f %.3f", pose.x, pose.y, pose.theta);
+    if (!render.readings[i]) {
       ROS_DEBUG("Reading is NULL");
       continue;
     }
 
-    if (n->reading->size() == 0) //do not clear again if already cleared!
+    GMapping::RangeBuffer& ranges = *render.readings[i];
+    if (ranges.size() == 0) //do not clear again if already cleared!
       continue;
-    if (n->pose.x < xmin_ || n->pose.x > xmax_ || n->pose.y < ymin_ || n->pose.y > ymax_) {
+    if (pose.x < xmin_ || pose.x > xmax_ || pose.y < ymin_ || pose.y > ymax_) {
       ROS_DEBUG("TNode is out of area, measurement is cleared");
-      ROS_DEBUG("capacity before clear: %lu", n->reading->capacity());
-      ROS_DEBUG("sizeof before clear: %lu", sizeof(n->reading));
-      n->reading->clear(); //KL: first had to make it r/w accessible, but now I can clear rangereading objects (vectors)
-      ROS_DEBUG("capacity after clear: %lu", n->reading->capacity());
-      ROS_DEBUG("sizeof after clear: %lu", sizeof(n->reading));
-      n->reading->shrink_to_fit(); //to free the memory. Officially requires c++11 (seems to work with c++0x to however!)
-      ROS_DEBUG("capacity after shrink to fit: %lu", n->reading->capacity());
-      ROS_DEBUG("sizeof after shrink to fit: %lu", sizeof(n->reading));
+      ROS_DEBUG("bytes before clear: %lu", ranges.bytes());
+      ranges.clear(); //frees the ranges of all the nodes of this scan
+      ROS_DEBUG("bytes after clear: %lu", ranges.bytes());
       continue;
     }
 
-    matcher.invalidateActiveArea();
-    matcher.computeActiveArea(smap, n->pose, &((*n->reading)[0]));
-    matcher.registerScan(smap, n->pose, &((*n->reading)[0]));
+    ranges.decode(&replay_ranges_[0]);
+    matcher.registerScanSinglePass(smap, pose, &replay_ranges_[0]);
+    rolling_map_poses_.push_back(pose);
+    rolling_map_readings_.push_back(render.readings[i]);
 
     // check if the latest scan is out of the current smaps area
-    if (n == best.node) {
+    if (i + 1 == render.poses.size()) {
       if (tmp_size_x != smap.getMapSizeX() || tmp_size_y != smap.getMapSizeY()) {
         scan_out_of_smap = true;
       }
     }
   }
+
+  // the nodes registered before are not replayed, but their scans are still freed once they leave the window
+  releaseScansOutOfWindow();
 }
 
-void SlamGMappingRolling::resizeAllSMaps(GMapping::ScanMatcherMap &smap, bool including_particles) {
+bool SlamGMappingRolling::changedPatches(const GMapping::ScanMatcherMap& map, GMapping::HierarchicalArray2D<GMapping::ScanMatcherCell>::PointList& patches) const
+{
+  // the previous copy holds all its patches, so a patch the particle has written since has been copied: its pointer differs
+  if (!particle_map_rendered_)
+    return false;
+  const GMapping::HierarchicalArray2D<GMapping::ScanMatcherCell>& now = map.storage();
+  const GMapping::HierarchicalArray2D<GMapping::ScanMatcherCell>& before = particle_map_rendered_->storage();
+  GMapping::Point origin = map.map2world(GMapping::IntPoint(0, 0));
+  GMapping::Point previous_origin = particle_map_rendered_->map2world(GMapping::IntPoint(0, 0));
+  if (now.getXSize() != before.getXSize() || now.getYSize() != before.getYSize() || origin.x != previous_origin.x || origin.y != previous_origin.y)
+    return false;
+  for (int x = 0; x < now.getXSize(); x++)
+    for (int y = 0; y < now.getYSize(); y++)
+      if (now.m_cells[x][y].m_reference != before.m_cells[x][y].m_reference)
+        patches.push_back(GMapping::IntPoint(x, y));
+  return true;
+}
 
-  xmin_ = -windowsize_ / 2.0 + gsp_->getParticles()[gsp_->getBestParticleIndex()].pose.x;
-  ymin_ = -windowsize_ / 2.0 + gsp_->getParticles()[gsp_->getBestParticleIndex()].pose.y;
-  xmax_ = windowsize_ / 2.0 + gsp_->getParticles()[gsp_->getBestParticleIndex()].pose.x;
-  ymax_ = windowsize_ / 2.0 + gsp_->getParticles()[gsp_->getBestParticleIndex()].pose.y;
+void SlamGMappingRolling::followParticleMap(const MapRender& render)
+{
+  // the nodes are not registered, but kept to free their scans once they leave the window
+  if (render.rebuild) {
+    rolling_map_poses_.clear();
+    rolling_map_readings_.clear();
+  }
+  for (unsigned int i = 0; i < render.poses.size(); i++)
+    if (render.readings[i]) {
+      rolling_map_poses_.push_back(render.poses[i]);
+      rolling_map_readings_.push_back(render.readings[i]);
+    }
+  // like the rendered map in rolling mode, the window follows the best particle once its map grows out of it
+  if (particle_map_rendered_ && (render.map->getMapSizeX() > particle_map_rendered_->getMapSizeX() || render.map->getMapSizeY() > particle_map_rendered_->getMapSizeY())) {
+    xmin_ = -windowsize_ / 2.0 + render.best_pose.x;
+    ymin_ = -windowsize_ / 2.0 + render.best_pose.y;
+    xmax_ = windowsize_ / 2.0 + render.best_pose.x;
+    ymax_ = windowsize_ / 2.0 + render.best_pose.y;
+    boost::mutex::scoped_lock render_lock(render_mutex_);
+    trim_particle_maps_ = true;
+  }
+  releaseScansOutOfWindow();
+}
+
+void SlamGMappingRolling::releaseScansOutOfWindow()
+{
+  unsigned int kept = 0;
+  for (unsigned int i = 0; i < rolling_map_poses_.size(); i++) {
+    const GMapping::OrientedPoint& pose = rolling_map_poses_[i];
+    if (pose.x < xmin_ || pose.x > xmax_ || pose.y < ymin_ || pose.y > ymax_) {
+      (*rolling_map_readings_[i]).clear();
+      continue;
+    }
+    rolling_map_poses_[kept] = pose;
+    rolling_map_readings_[kept++] = rolling_map_readings_[i];
+  }
+  rolling_map_poses_.resize(kept);
+  rolling_map_readings_.resize(kept);
+}
+
+void SlamGMappingRolling::resizeAllSMaps(GMapping::ScanMatcherMap &smap, const GMapping::OrientedPoint& best_pose, bool including_particles) {
+
+  xmin_ = -windowsize_ / 2.0 + best_pose.x;
+  ymin_ = -windowsize_ / 2.0 + best_pose.y;
+  xmax_ = windowsize_ / 2.0 + best_pose.x;
+  ymax_ = windowsize_ / 2.0 + best_pose.y;
 
 //update the map used for visualization
   smap.resize(xmin_, ymin_, xmax_, ymax_);
@@ -804,22 +1143,139 @@ void SlamGMappingRolling::resizeAllSMaps(GMapping::ScanMatcherMap &smap, bool in
    center.x = (xmin_ + xmax_) / 2.0;
    center.y = (ymin_ + ymax_) / 2.0;
    smap.setCenter(center);*/
-//update all the maps stored in the particles
+//update all the maps stored in the particles, which belong to the SLAM thread: it trims them after its next scan
   if (including_particles == true) {
-    //update all the maps stored in the particles
-    for (int i = 0; i < particles_; i++) {
-      int xmin, ymin, xmax, ymax;
-      xmin = -windowsize_ / 2 + gsp_->getParticles().at(i).pose.x;
-      ymin = -windowsize_ / 2 + gsp_->getParticles().at(i).pose.y;
-      xmax = windowsize_ / 2 + gsp_->getParticles().at(i).pose.x;
-      ymax = windowsize_ / 2 + gsp_->getParticles().at(i).pose.y;
-      gsp_->getParticlesRW().at(i).map.resize(xmin, ymin, xmax, ymax);
-      ROS_INFO("smap %d has size %lu bytes", i, sizeof(gsp_->getParticlesRW().at(i).map));
-      //gsp_->getParticlesRW().at(i).map.setCenter(center);
+    boost::mutex::scoped_lock render_lock(render_mutex_);
+    trim_particle_maps_ = true;
+  }
+}
+
+void SlamGMappingRolling::trimParticleMaps(double windowsize) {
+  // the patches falling out of the window of a particle are released by its map
+  for (int i = 0; i < particles_; i++) {
+    const GMapping::OrientedPoint& pose = gsp_->getParticles().at(i).pose;
+    GMapping::ScanMatcherMap& map = gsp_->getParticlesRW().at(i).map;
+    map.resize(pose.x - windowsize / 2, pose.y - windowsize / 2, pose.x + windowsize / 2, pose.y + windowsize / 2);
+    GMapping::GridSlamProcessor::MapStatistics stats = map.storage().patchStatistics();
+    ROS_DEBUG("smap %d has %u patches (%u shared), %lu bytes", i, stats.patches, stats.shared, stats.bytes());
+  }
+}
+
+void SlamGMappingRolling::accountMapMemory() {
+  std::vector<GMapping::GridSlamProcessor::MapStatistics> particles;
+  GMapping::GridSlamProcessor::MapStatistics total = gsp_->mapStatistics(&particles);
+  ROS_DEBUG("particle maps: %u patches, %u shared, %.1f MB (%.1f MB not shared)",
+            total.patches, total.shared, total.bytes() / 1048576.0, total.uniqueBytes / 1048576.0);
+
+  double budget = map_memory_budget_ * 1048576.0;
+  if (rolling_ && budget > 0 && total.bytes() > budget) {
+    // evict the patches out of the rolling window, narrowing it until the maps fit
+    double windowsize = windowsize_;
+    double min_windowsize = 2 * maxUrange_;
+    ROS_WARN("particle maps take %.1f MB, over the budget of %.1f MB: evicting the patches out of the rolling window",
+             total.bytes() / 1048576.0, map_memory_budget_);
+    while (true) {
+      trimParticleMaps(windowsize);
+      total = gsp_->mapStatistics(&particles);
+      if (total.bytes() <= budget || windowsize <= min_windowsize)
+        break;
+      windowsize = std::max(windowsize * 0.75, min_windowsize);
+      ROS_WARN("particle maps still take %.1f MB, narrowing the window to %.1f m", total.bytes() / 1048576.0, windowsize);
+    }
+    if (total.bytes() > budget)
+      ROS_ERROR("particle maps take %.1f MB, over the budget of %.1f MB even within %.1f m",
+                total.bytes() / 1048576.0, map_memory_budget_, windowsize);
+  }
+
+  std_msgs::Float64MultiArray memory;
+  memory.layout.dim.resize(2);
+  memory.layout.dim[0].label = "map";
+  memory.layout.dim[0].size = particles.size() + 1;
+  memory.layout.dim[0].stride = 4 * (particles.size() + 1);
+  memory.layout.dim[1].label = "patches,shared,unique_bytes,bytes";
+  memory.layout.dim[1].size = 4;
+  memory.layout.dim[1].stride = 4;
+  particles.push_back(total);
+  for (unsigned int i = 0; i < particles.size(); i++) {
+    memory.data.push_back(particles[i].patches);
+    memory.data.push_back(particles[i].shared);
+    memory.data.push_back(particles[i].uniqueBytes);
+    memory.data.push_back(particles[i].bytes());
+  }
+  map_memory_publisher_.publish(memory);
+}
+
+void SlamGMappingRolling::renderMap(const GMapping::ScanMatcherMap& smap, nav_msgs::OccupancyGrid& map, int xmin, int ymin, int xmax, int ymax)
+{
+  // row-major, the layout of the message, so that each row of the region is written contiguously
+  for (int y = ymin; y < ymax; y++) {
+    int8_t* row = &map.data[MAP_IDX(map.info.width, 0, y)];
+    for (int x = xmin; x < xmax; x++) {
+      /// @todo Sort out the unknown vs. free vs. obstacle thresholding
+      double occ = smap.cell(x, y);
+      assert(occ <= 1.0);
+      if (occ < 0)
+        row[x] = -1;
+      else if (occ > occ_thresh_)
+        row[x] = 100; //(int)round(occ*100.0)
+      else
+        row[x] = 0;
     }
   }
 }
 
+void SlamGMappingRolling::publishMapUpdates(const GMapping::HierarchicalArray2D<GMapping::ScanMatcherCell>::PointList& patches, int patch_size)
+{
+  // the patches come sorted by column, then row: the runs of rows of a column are joined into strips,
+  // and a strip into the rectangle of the previous column if it spans the same rows
+  std::vector<map_msgs::OccupancyGridUpdate> updates;
+  for (unsigned int i = 0; i < patches.size();) {
+    int x = patches[i].x, y0 = patches[i].y, y1 = y0 + 1;
+    for (i++; i < patches.size() && patches[i].x == x && patches[i].y == y1; i++)
+      y1++;
+    map_msgs::OccupancyGridUpdate* last = updates.empty() ? NULL : &updates.back();
+    if (last && last->y == y0 && (int) last->height == y1 - y0 && last->x + (int) last->width == x) {
+      last->width++;
+      continue;
+    }
+    updates.push_back(map_msgs::OccupancyGridUpdate());
+    updates.back().x = x;
+    updates.back().y = y0;
+    updates.back().width = 1;
+    updates.back().height = y1 - y0;
+  }
+
+  for (unsigned int i = 0; i < updates.size(); i++) {
+    // from patches to cells, clipped to the map
+    map_msgs::OccupancyGridUpdate& update = updates[i];
+    int xmin = update.x * patch_size, ymin = update.y * patch_size;
+    int xmax = std::min<int>(xmin + update.width * patch_size, map_.map.info.width);
+    int ymax = std::min<int>(ymin + update.height * patch_size, map_.map.info.height);
+    if (xmax <= xmin || ymax <= ymin)
+      continue;
+    update.header = map_.map.header;
+    update.x = xmin;
+    update.y = ymin;
+    update.width = xmax - xmin;
+    update.height = ymax - ymin;
+    update.data.resize(update.width * update.height);
+    for (int y = ymin; y < ymax; y++) {
+      const int8_t* row = &map_.map.data[MAP_IDX(map_.map.info.width, xmin, y)];
+      std::copy(row, row + update.width, &update.data[MAP_IDX(update.width, 0, y - ymin)]);
+    }
+    map_updates_publisher_.publish(update);
+  }
+  ROS_DEBUG("published %lu patches of the map in %lu updates", patches.size(), updates.size());
+}
+
+void SlamGMappingRolling::mapSubscribed(const ros::SingleSubscriberPublisher& pub)
+{
+  // the latched map may be older than the updates published since, the new subscriber gets the current one
+  boost::mutex::scoped_lock map_lock(map_mutex_);
+  if (got_map_)
+    pub.publish(map_.map);
+}
+
 void SlamGMappingRolling::resizeMapMsg(const GMapping::ScanMatcherMap &smap) {
 // if the map has expanded, resize the map msg
   if (map_.map.info.width != (unsigned int) smap.getMapSizeX() || map_.map.info.height != (unsigned int) smap.getMapSizeY()) {
@@ -985,25 +1441,7 @@ void SlamGMappingRolling::publishMapPX()
     ROS_DEBUG("map origin: (%f, %f)", map_px_.map.info.origin.position.x, map_px_.map.info.origin.position.y);
   }
 
-  for (int x = 0; x < current_p.map.getMapSizeX(); x++)
-      {
-    for (int y = 0; y < current_p.map.getMapSizeY(); y++)
-        {
-      /// @todo Sort out the unknown vs. free vs. obstacle thresholding
-      GMapping::IntPoint p(x, y);
-      double occ = current_p.map.cell(p);
-      assert(occ <= 1.0);
-      if (occ < 0)
-        map_px_.map.data[MAP_IDX(map_px_.map.info.width, x, y)] = -1;
-      else if (occ > occ_thresh_)
-          {
-        //map_px_.map.data[MAP_IDX(map_px_.map.info.width, x, y)] = (int)round(occ*100.0);
-        map_px_.map.data[MAP_IDX(map_px_.map.info.width, x, y)] = 100;
-      }
-      else
-        map_px_.map.data[MAP_IDX(map_px_.map.info.width, x, y)] = 0;
-    }
-  }
+  renderMap(current_p.map, map_px_.map, 0, 0, current_p.map.getMapSizeX(), current_p.map.getMapSizeY());
   got_map_px_ = true;
 
   //make sure to set the header information on the map
@@ -1054,40 +1492,20 @@ bool SlamGMappingRolling::mapCallback(nav_msgs::GetMap::Request &req,
     return false;
 }
 
-void SlamGMappingRolling::publishTransform()
+ros::Time SlamGMappingRolling::publishTransform()
 {
-  map_to_odom_mutex_.lock();
+  ros::Time stamp;
+  tf::Transform map_to_odom = getMapToOdom(stamp);
   ros::Time tf_expiration = ros::Time::now() + ros::Duration(tf_delay_);
-  tfB_->sendTransform(tf::StampedTransform(map_to_odom_, tf_expiration, map_frame_, odom_frame_));
-  map_to_odom_mutex_.unlock();
+  tfB_->sendTransform(tf::StampedTransform(map_to_odom, tf_expiration, map_frame_, odom_frame_));
+  return stamp;
 }
 
-void SlamGMappingRolling::updateMapOrig(const sensor_msgs::LaserScan& scan)
+void SlamGMappingRolling::updateMapOrig(const MapRender& render)
 {
   boost::mutex::scoped_lock map_lock(map_mutex_);
   GMapping::ScanMatcher matcher;
-  double* laser_angles = new double[scan.ranges.size()];
-  double theta = angle_min_;
-  for (unsigned int i = 0; i < scan.ranges.size(); i++)
-      {
-    if (gsp_laser_angle_increment_ < 0)
-      laser_angles[scan.ranges.size() - i - 1] = theta;
-    else
-      laser_angles[i] = theta;
-    theta += gsp_laser_angle_increment_;
-  }
-  matcher.setLaserParameters(scan.ranges.size(), laser_angles,
-      gsp_laser_->getPose());
-  delete[] laser_angles;
-  matcher.setlaserMaxRange(maxRange_);
-  matcher.setusableRange(maxUrange_);
-  matcher.setgenerateMap(true);
-  GMapping::GridSlamProcessor::Particle best =
-      gsp_->getParticles()[gsp_->getBestParticleIndex()];
-  std_msgs::Float64 entropy;
-  entropy.data = computePoseEntropy();
-  if (entropy.data > 0.0)
-    entropy_publisher_.publish(entropy);
+  setupRenderMatcher(matcher, *render.scan);
   if (!got_map_) {
     map_.map.info.resolution = delta_;
     map_.map.info.origin.position.x = 0.0;
@@ -1103,22 +1521,19 @@ void SlamGMappingRolling::updateMapOrig(const sensor_msgs::LaserScan& scan)
   center.y = (ymin_ + ymax_) / 2.0;
   GMapping::ScanMatcherMap smap(center, xmin_, ymin_, xmax_, ymax_, delta_);
   ROS_DEBUG("Trajectory tree:");
-  for (GMapping::GridSlamProcessor::TNode* n = best.node;
-      n;
-      n = n->parent)
+  for (unsigned int i = 0; i < render.poses.size(); i++)
           {
     ROS_DEBUG(" %.3f %.3f %.3f",
-        n->pose.x,
-        n->pose.y,
-        n->pose.theta);
-    if (!n->reading)
+        render.poses[i].x,
+        render.poses[i].y,
+        render.poses[i].theta);
+    if (!render.readings[i] || (*render.readings[i]).size() == 0)
     {
       ROS_DEBUG("Reading is NULL");
       continue;
     }
-    matcher.invalidateActiveArea();
-    matcher.computeActiveArea(smap, n->pose, &((*n->reading)[0]));
-    matcher.registerScan(smap, n->pose, &((*n->reading)[0]));
+    (*render.readings[i]).decode(&replay_ranges_[0]);
+    matcher.registerScanSinglePass(smap, render.poses[i], &replay_ranges_[0]);
   }
 // if the map has expanded, resize the map msg and all particle GMapping::ScanMatcherMaps
   if (map_.map.info.width != (unsigned int) smap.getMapSizeX() || map_.map.info.height != (unsigned int) smap.getMapSizeY()) {
@@ -1139,43 +1554,11 @@ void SlamGMappingRolling::updateMapOrig(const sensor_msgs::LaserScan& scan)
     map_.map.data.resize(map_.map.info.width * map_.map.info.height);
     ROS_DEBUG("map origin: (%f, %f)", map_.map.info.origin.position.x, map_.map.info.origin.position.y);
   }
-  for (int x = 0; x < smap.getMapSizeX(); x++)
-      {
-    for (int y = 0; y < smap.getMapSizeY(); y++)
-        {
-/// @todo Sort out the unknown vs. free vs. obstacle thresholding
-      GMapping::IntPoint p(x, y);
-      double occ = smap.cell(p);
-      assert(occ <= 1.0);
-      if (occ < 0)
-        map_.map.data[MAP_IDX(map_.map.info.width, x, y)] = -1;
-      else if (occ > occ_thresh_)
-          {
-//map_.map.data[MAP_IDX(map_.map.info.width, x, y)] = (int)round(occ*100.0);
-        map_.map.data[MAP_IDX(map_.map.info.width, x, y)] = 100;
-      }
-      else
-        map_.map.data[MAP_IDX(map_.map.info.width, x, y)] = 0;
-    }
-  }
+  renderMap(smap, map_.map, 0, 0, smap.getMapSizeX(), smap.getMapSizeY());
   got_map_ = true;
 //make sure to set the header information on the map
   map_.map.header.stamp = ros::Time::now();
   map_.map.header.frame_id = tf_.resolve(map_frame_);
   sst_.publish(map_.map);
   sstm_.publish(map_.map.info);
-// KL Visualize and store all paths / maps
-  ROS_DEBUG("Best particle is %d", gsp_->getBestParticleIndex());
-  if (publish_all_paths_ || publish_current_path_) {
-    updateAllPaths();
-    if (publish_all_paths_) {
-      publishAllPaths();
-    }
-    if (publish_current_path_) {
-      publishCurrentPath();
-    }
-  }
-  if (publish_specific_map_ >= 0) {
-    publishMapPX();
-  }
 }
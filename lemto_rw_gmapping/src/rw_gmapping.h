@@ -19,7 +19,9 @@
 #include "ros/ros.h"
 #include "sensor_msgs/LaserScan.h"
 #include "std_msgs/Float64.h"
+#include "std_msgs/Float64MultiArray.h"
 #include "nav_msgs/GetMap.h"
+#include "map_msgs/OccupancyGridUpdate.h"
 #include "tf/transform_listener.h"
 #include "tf/transform_broadcaster.h"
 #include "message_filters/subscriber.h"
@@ -29,6 +31,7 @@
 #include "gmapping/sensor/sensor_base/sensor.h"
 
 #include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
 
 // KL Visualize and store all paths / maps
 #include <visualization_msgs/Marker.h>
@@ -43,7 +46,8 @@ public:
   SlamGMappingRolling();
   ~SlamGMappingRolling();
 
-  void publishTransform();
+  /**@returns the stamp of the scan the transform published comes from*/
+  ros::Time publishTransform();
 
   void laserCallback(const sensor_msgs::LaserScan::ConstPtr& scan);
   bool mapCallback(nav_msgs::GetMap::Request &req,
@@ -56,6 +60,8 @@ private:
   ros::Publisher entropy_publisher_;
   ros::Publisher sst_;
   ros::Publisher sstm_;
+  ros::Publisher map_updates_publisher_;
+  ros::Publisher map_memory_publisher_;
   ros::ServiceServer ss_;
   tf::TransformListener tf_;
   message_filters::Subscriber<sensor_msgs::LaserScan>* scan_filter_sub_;
@@ -68,6 +74,7 @@ private:
   double angle_min_;
   double angle_max_;
   unsigned int gsp_laser_beam_count_;
+  std::vector<double> replay_ranges_; //the ranges of a node of the trajectory tree, decoded to replay its scan
   GMapping::OdometrySensor* gsp_odom_;
 
   bool got_first_scan_;
@@ -76,8 +83,31 @@ private:
   nav_msgs::GetMap::Response map_;
 
   ros::Duration map_update_interval_;
+  bool publish_map_updates_;
+  ros::Duration map_snapshot_interval_;
+  ros::Time last_map_snapshot_;
+  // written by the SLAM thread and read by transform_thread_ under a seqlock, see setMapToOdom()
   tf::Transform map_to_odom_;
-  boost::mutex map_to_odom_mutex_;
+  ros::Time map_to_odom_stamp_;
+  volatile unsigned int map_to_odom_seq_;
+  void setMapToOdom(const tf::Transform& map_to_odom, const ros::Time& stamp);
+  tf::Transform getMapToOdom(ros::Time& stamp) const;
+
+  // the timing of the transforms published by transform_thread_
+  struct TransformTiming {
+    unsigned int sent;
+    unsigned int intervals;
+    double sum, sum2;
+    double max_interval;
+    double max_jitter; //largest difference of an interval from the period
+    double max_age; //largest age of the pose sent
+    ros::WallTime last;
+    TransformTiming() : sent(0), intervals(0), sum(0), sum2(0), max_interval(0), max_jitter(0), max_age(0) {}
+    void add(const ros::WallTime& now, const ros::Time& stamp, double period);
+  };
+  double tf_jitter_period_;
+  ros::Publisher tf_jitter_publisher_;
+  void publishTransformTiming(const TransformTiming& timing);
   boost::mutex map_mutex_;
 
   int laser_count_;
@@ -90,7 +120,20 @@ private:
   std::string map_frame_;
   std::string odom_frame_;
 
-  void updateMap(const sensor_msgs::LaserScan& scan);
+  // the map is rendered by render_thread_, from the snapshots of the best trajectory posted by laserCallback
+  struct MapRender {
+    sensor_msgs::LaserScan::ConstPtr scan; //for the laser parameters
+    bool rebuild; //the nodes are the whole best trajectory, not the ones added since the previous render
+    std::vector<GMapping::OrientedPoint> poses; //the nodes to register, oldest first
+    std::vector<GMapping::RangeBufferPtr> readings;
+    GMapping::OrientedPoint best_pose;
+    boost::shared_ptr<GMapping::ScanMatcherMap> map; //with render_particle_map, the map of the best particle, rendered instead of registering the nodes
+    MapRender() : rebuild(false) {}
+  };
+  void postMapRender(const sensor_msgs::LaserScan::ConstPtr& scan);
+  void renderLoop();
+  void setupRenderMatcher(GMapping::ScanMatcher& matcher, const sensor_msgs::LaserScan& scan);
+  void updateMap(const MapRender& render);
   bool getOdomPose(GMapping::OrientedPoint& gmap_pose, const ros::Time& t);
   bool initMapper(const sensor_msgs::LaserScan& scan);
   bool addScan(const sensor_msgs::LaserScan& scan, GMapping::OrientedPoint& gmap_pose);
@@ -109,15 +152,28 @@ private:
   double lsigma_;
   double ogain_;
   int lskip_;
+  bool likelihood_field_;
+  int multi_resolution_levels_;
+  bool correlative_matching_;
+  double correlative_linear_window_;
+  double correlative_angular_window_;
   double srr_; //Odometry error in translation as a function of translation (rho/rho)
   double srt_; //Odometry error in translation as a function of rotation (rho/theta)
   double str_; //Odometry error in rotation as a function of translation (theta/rho)
   double stt_; //Odometry error in rotation as a function of rotation (theta/theta)
+  int motion_model_seed_;
   double linearUpdate_;
   double angularUpdate_;
   double temporalUpdate_;
   double resampleThreshold_;
+  std::string resampling_;
+  int resampling_seed_;
   int particles_;
+  int threads_;
+  bool quantize_ranges_;
+  double range_resolution_;
+  int patch_pool_reserve_;
+  int patch_pool_slab_;
   double xmin_;
   double ymin_;
   double xmax_;
@@ -133,6 +189,7 @@ private:
 
   double windowsize_;
   bool rolling_; //KL
+  double map_memory_budget_; //MB, 0 for no budget
 
   // Visualize and store all paths and maps
   geometry_msgs::Pose gMapPoseToGeoPose(const GMapping::OrientedPoint& gmap_pose) const;
@@ -158,11 +215,41 @@ private:
   bool got_map_px_;
 
   std::vector<GMapping::ScanMatcherMap> smap_vector_; //for resize
+  GMapping::ScanMatcherMap* rolling_map_; //the map rendered in rolling mode, kept from one update to the next
+  GMapping::GridSlamProcessor::TNode* rolling_map_node_; //the last node posted for rolling_map_
+  GMapping::RangeBufferPtr rolling_map_reading_; //its reading, held so that the node cannot be mistaken for a later one
+  bool rolling_map_rebuilt_; //rolling_map_ has been rebuilt since it was last rendered
+  std::vector<GMapping::OrientedPoint> rolling_map_poses_; //the nodes registered in rolling_map_ within the window,
+  std::vector<GMapping::RangeBufferPtr> rolling_map_readings_; //whose scans are freed when they leave it
+  boost::shared_ptr<GMapping::ScanMatcherMap> particle_map_rendered_; //the copy of the best particle map rendered last, if it was rendered last
+  bool render_particle_map_;
+  ros::Duration map_replay_interval_;
+  ros::Time last_map_replay_;
+  bool changedPatches(const GMapping::ScanMatcherMap& map, GMapping::HierarchicalArray2D<GMapping::ScanMatcherCell>::PointList& patches) const;
+  void followParticleMap(const MapRender& render);
+  void releaseScansOutOfWindow();
+
+  // only render_thread_ touches the map rendered and the ranges of the nodes; the particles are left to the SLAM thread
+  boost::thread* render_thread_;
+  boost::mutex render_mutex_; //guards what follows
+  boost::condition_variable render_cond_;
+  MapRender render_pending_;
+  bool render_posted_;
+  bool render_stop_;
+  bool trim_particle_maps_; //the window has moved, the particle maps are to follow
+  unsigned long renders_requested_;
+  unsigned long renders_coalesced_; //posted while the previous one was still pending, and merged into it
+  unsigned long renders_done_;
   void updateMapDefault(const sensor_msgs::LaserScan& scan, GMapping::ScanMatcherMap& smap);
-  void updateMapRollingMode(const sensor_msgs::LaserScan& scan, GMapping::ScanMatcherMap& smap, bool& scan_out_of_smap);
-  void updateMapOrig(const sensor_msgs::LaserScan& scan);
+  void updateMapRollingMode(const MapRender& render, GMapping::ScanMatcherMap& smap, bool& scan_out_of_smap);
+  void updateMapOrig(const MapRender& render);
 
   void resizeMapMsg(const GMapping::ScanMatcherMap &smap);
-  void resizeAllSMaps(GMapping::ScanMatcherMap &smap, bool including_particles = true);
+  void publishMapUpdates(const GMapping::HierarchicalArray2D<GMapping::ScanMatcherCell>::PointList& patches, int patch_size);
+  void mapSubscribed(const ros::SingleSubscriberPublisher& pub);
+  void renderMap(const GMapping::ScanMatcherMap& smap, nav_msgs::OccupancyGrid& map, int xmin, int ymin, int xmax, int ymax);
+  void resizeAllSMaps(GMapping::ScanMatcherMap &smap, const GMapping::OrientedPoint& best_pose, bool including_particles = true);
+  void trimParticleMaps(double windowsize);
+  void accountMapMemory();
 
 };
@@ -0,0 +1,105 @@
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <sys/time.h>
+#include "array2d.h"
+#include "contiguousarray2d.h"
+
+using namespace std;
+using namespace GMapping;
+
+/*compares the storage of the patches of a HierarchicalArray2D: one array per column (Array2D)
+against a single aligned buffer (ContiguousArray2D). It measures the operations the filter does
+on the patches: allocating them, copying them when a particle writes to a shared patch, and
+reading cells at scattered positions while scan matching.*/
+
+struct BenchCell{
+	BenchCell(): x(0), y(0), n(0), visits(0){}
+	float x, y;
+	int n, visits;
+};
+
+static double now(){
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec+1e-6*tv.tv_usec;
+}
+
+template <class Patch>
+double allocate(int patches, int size){
+	double t=now();
+	vector<Patch*> v(patches);
+	for (int i=0; i<patches; i++)
+		v[i]=new Patch(size, size);
+	for (int i=0; i<patches; i++)
+		delete v[i];
+	return now()-t;
+}
+
+template <class Patch>
+double copy(int patches, int size){
+	Patch original(size, size);
+	for (int x=0; x<size; x++)
+		for (int y=0; y<size; y++)
+			original.cell(x,y).n=x+y;
+	double t=now();
+	vector<Patch*> v(patches);
+	for (int i=0; i<patches; i++)
+		v[i]=new Patch(original);
+	for (int i=0; i<patches; i++)
+		delete v[i];
+	return now()-t;
+}
+
+template <class Patch>
+double access(int patches, int size, const vector<int>& indexes, int& checksum){
+	vector<Patch*> v(patches);
+	for (int i=0; i<patches; i++)
+		v[i]=new Patch(size, size);
+	double t=now();
+	for (unsigned int i=0; i+2<indexes.size(); i+=3){
+		BenchCell& c=v[indexes[i]]->cell(indexes[i+1], indexes[i+2]);
+		c.visits++;
+		checksum+=c.n;
+	}
+	t=now()-t;
+	for (int i=0; i<patches; i++)
+		delete v[i];
+	return t;
+}
+
+int main (int argc, char ** argv){
+	int patches=argc>1?atoi(argv[1]):4096;
+	int size=argc>2?atoi(argv[2]):32;
+	int accesses=argc>3?atoi(argv[3]):10000000;
+	int repeats=argc>4?atoi(argv[4]):5;
+
+	srand(0);
+	vector<int> indexes(3*accesses);
+	for (int i=0; i<accesses; i++){
+		indexes[3*i]=rand()%patches;
+		indexes[3*i+1]=rand()%size;
+		indexes[3*i+2]=rand()%size;
+	}
+
+	double ta=0, tc=0, tr=0, ca=0, cc=0, cr=0;
+	int sa=0, sc=0;
+	for (int r=0; r<repeats; r++){
+		ta+=allocate< Array2D<BenchCell> >(patches, size);
+		ca+=allocate< ContiguousArray2D<BenchCell> >(patches, size);
+		tc+=copy< Array2D<BenchCell> >(patches, size);
+		cc+=copy< ContiguousArray2D<BenchCell> >(patches, size);
+		tr+=access< Array2D<BenchCell> >(patches, size, indexes, sa);
+		cr+=access< ContiguousArray2D<BenchCell> >(patches, size, indexes, sc);
+	}
+	cout << patches << " patches of " << size << "x" << size << " cells, " << repeats << " repeats" << endl;
+	cout << "operation    Array2D[s]   ContiguousArray2D[s]" << endl;
+	cout << "allocate     " << ta << "\t" << ca << endl;
+	cout << "copy         " << tc << "\t" << cc << endl;
+	cout << "access       " << tr << "\t" << cr << endl;
+	if (sa!=sc){
+		cerr << "checksum mismatch " << sa << " " << sc << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -26,6 +26,12 @@ GridSlamProcessor::GridSlamProcessor() :
   m_obsSigmaGain = 1;
   m_resampleThreshold = 0.5;
   m_minimumScore = 0.;
+  m_useLikelihoodField = false;
+  m_multiResolutionLevels = 0;
+  m_useCorrelativeMatching = false;
+  m_motionSeed = 0;
+  m_readingEncoding = RangeBuffer::Float;
+  m_readingResolution = 0.001;
 }
 
 GridSlamProcessor::GridSlamProcessor(const GridSlamProcessor& gsp)
@@ -38,12 +44,21 @@ GridSlamProcessor::GridSlamProcessor(const GridSlamProcessor& gsp)
   m_obsSigmaGain = gsp.m_obsSigmaGain;
   m_resampleThreshold = gsp.m_resampleThreshold;
   m_minimumScore = gsp.m_minimumScore;
+  m_useLikelihoodField = gsp.m_useLikelihoodField;
+  m_multiResolutionLevels = gsp.m_multiResolutionLevels;
+  m_useCorrelativeMatching = gsp.m_useCorrelativeMatching;
 
   m_beams = gsp.m_beams;
   m_indexes = gsp.m_indexes;
+  m_resampler = gsp.m_resampler;
   m_motionModel = gsp.m_motionModel;
+  m_motionSamplers = gsp.m_motionSamplers;
+  m_motionSeed = gsp.m_motionSeed;
+  m_readingEncoding = gsp.m_readingEncoding;
+  m_readingResolution = gsp.m_readingResolution;
   m_resampleThreshold = gsp.m_resampleThreshold;
   m_matcher = gsp.m_matcher;
+  m_workerPool.resize(gsp.m_workerPool.size());
 
   m_count = gsp.m_count;
   m_readingCount = gsp.m_readingCount;
@@ -53,6 +68,8 @@ GridSlamProcessor::GridSlamProcessor(const GridSlamProcessor& gsp)
   m_linearDistance = gsp.m_linearDistance;
   m_angularDistance = gsp.m_angularDistance;
   m_neff = gsp.m_neff;
+  m_poseEntropy = gsp.m_poseEntropy;
+  m_resampleCopyBytes = gsp.m_resampleCopyBytes;
 
   cerr << "FILTER COPY CONSTRUCTOR" << endl;
   cerr << "m_odoPose=" << m_odoPose.x << " " << m_odoPose.y << " " << m_odoPose.theta << endl;
@@ -97,6 +114,12 @@ GridSlamProcessor::GridSlamProcessor(std::ostream& infoS) :
   m_obsSigmaGain = 1;
   m_resampleThreshold = 0.5;
   m_minimumScore = 0.;
+  m_useLikelihoodField = false;
+  m_multiResolutionLevels = 0;
+  m_useCorrelativeMatching = false;
+  m_motionSeed = 0;
+  m_readingEncoding = RangeBuffer::Float;
+  m_readingResolution = 0.001;
 
 }
 
@@ -104,14 +127,14 @@ GridSlamProcessor* GridSlamProcessor::clone() const
 {
 # ifdef MAP_CONSISTENCY_CHECK
   cerr << __PRETTY_FUNCTION__ << ": performing preclone_fit_test" << endl;
-  typedef std::map<autoptr< Array2D<PointAccumulator> >::reference* const, int> PointerMap;
+  typedef std::map<HierarchicalArray2D<ScanMatcherCell>::PatchPtr::reference* const, int> PointerMap;
   PointerMap pmap;
   for (ParticleVector::const_iterator it=m_particles.begin(); it!=m_particles.end(); it++) {
     const ScanMatcherMap& m1(it->map);
-    const HierarchicalArray2D<PointAccumulator>& h1(m1.storage());
+    const HierarchicalArray2D<ScanMatcherCell>& h1(m1.storage());
     for (int x=0; x<h1.getXSize(); x++) {
       for (int y=0; y<h1.getYSize(); y++) {
-        const autoptr< Array2D<PointAccumulator> >& a1(h1.m_cells[x][y]);
+        const HierarchicalArray2D<ScanMatcherCell>::PatchPtr& a1(h1.m_cells[x][y]);
         if (a1.m_reference) {
           PointerMap::iterator f=pmap.find(a1.m_reference);
           if (f==pmap.end())
@@ -137,13 +160,13 @@ GridSlamProcessor* GridSlamProcessor::clone() const
   for (ParticleVector::const_iterator it=m_particles.begin(); it!=m_particles.end(); it++) {
     const ScanMatcherMap& m1(it->map);
     const ScanMatcherMap& m2(jt->map);
-    const HierarchicalArray2D<PointAccumulator>& h1(m1.storage());
-    const HierarchicalArray2D<PointAccumulator>& h2(m2.storage());
+    const HierarchicalArray2D<ScanMatcherCell>& h1(m1.storage());
+    const HierarchicalArray2D<ScanMatcherCell>& h2(m2.storage());
     jt++;
     for (int x=0; x<h1.getXSize(); x++) {
       for (int y=0; y<h1.getYSize(); y++) {
-        const autoptr< Array2D<PointAccumulator> >& a1(h1.m_cells[x][y]);
-        const autoptr< Array2D<PointAccumulator> >& a2(h2.m_cells[x][y]);
+        const HierarchicalArray2D<ScanMatcherCell>::PatchPtr& a1(h1.m_cells[x][y]);
+        const HierarchicalArray2D<ScanMatcherCell>::PatchPtr& a2(h2.m_cells[x][y]);
         assert(a1.m_reference==a2.m_reference);
         assert((!a1.m_reference) || !(a1.m_reference->shares%2));
       }
@@ -172,14 +195,14 @@ GridSlamProcessor::~GridSlamProcessor()
 
 # ifdef MAP_CONSISTENCY_CHECK
   cerr << __PRETTY_FUNCTION__ << ": performing predestruction_fit_test" << endl;
-  typedef std::map<autoptr< Array2D<PointAccumulator> >::reference* const, int> PointerMap;
+  typedef std::map<HierarchicalArray2D<ScanMatcherCell>::PatchPtr::reference* const, int> PointerMap;
   PointerMap pmap;
   for (ParticleVector::const_iterator it=m_particles.begin(); it!=m_particles.end(); it++) {
     const ScanMatcherMap& m1(it->map);
-    const HierarchicalArray2D<PointAccumulator>& h1(m1.storage());
+    const HierarchicalArray2D<ScanMatcherCell>& h1(m1.storage());
     for (int x=0; x<h1.getXSize(); x++) {
       for (int y=0; y<h1.getYSize(); y++) {
-        const autoptr< Array2D<PointAccumulator> >& a1(h1.m_cells[x][y]);
+        const HierarchicalArray2D<ScanMatcherCell>::PatchPtr& a1(h1.m_cells[x][y]);
         if (a1.m_reference) {
           PointerMap::iterator f=pmap.find(a1.m_reference);
           if (f==pmap.end())
@@ -197,6 +220,43 @@ GridSlamProcessor::~GridSlamProcessor()
 # endif
 }
 
+GridSlamProcessor::MapStatistics GridSlamProcessor::mapStatistics(std::vector<MapStatistics>* particles) const
+{
+  typedef HierarchicalArray2D<ScanMatcherCell> Storage;
+  std::vector<const Storage::PatchPtr::reference*> patches;
+  MapStatistics total;
+  if (particles)
+    particles->resize(m_particles.size());
+  for (unsigned int i = 0; i < m_particles.size(); i++) {
+    const Storage& storage = m_particles[i].map.storage();
+    if (particles)
+      (*particles)[i] = storage.patchStatistics();
+    total.tableBytes += storage.getTableBytes();
+    for (int x = 0; x < storage.getXSize(); x++)
+      for (int y = 0; y < storage.getYSize(); y++)
+        if (storage.m_cells[x][y])
+          patches.push_back(storage.m_cells[x][y].m_reference);
+  }
+  if (patches.empty())
+    return total;
+
+  //a patch is shared if it appears in more than one map
+  std::sort(patches.begin(), patches.end());
+  for (unsigned int i = 0; i < patches.size();) {
+    unsigned int j = i + 1;
+    while (j < patches.size() && patches[j] == patches[i])
+      j++;
+    total.patches++;
+    if (j - i > 1)
+      total.shared++;
+    i = j;
+  }
+  size_t patchBytes = m_particles.front().map.storage().getPatchBytes();
+  total.patchBytes = total.patches * patchBytes;
+  total.uniqueBytes = (total.patches - total.shared) * patchBytes;
+  return total;
+}
+
 void GridSlamProcessor::setMatchingParameters(double urange, double range, double sigma, int kernsize, double lopt, double aopt,
                                               int iterations,
                                               double likelihoodSigma, double likelihoodGain, unsigned int likelihoodSkip)
@@ -214,6 +274,50 @@ void GridSlamProcessor::setMatchingParameters(double urange, double range, doubl
 
 }
 
+void GridSlamProcessor::setthreads(unsigned int threads)
+{
+  m_workerPool.resize(threads);
+  if (m_infoStream)
+    m_infoStream << " -threads " << m_workerPool.size() << endl;
+}
+
+void GridSlamProcessor::setuseLikelihoodField(bool use)
+{
+  m_useLikelihoodField = use;
+  for (ParticleVector::iterator it = m_particles.begin(); it != m_particles.end(); it++) {
+    it->field.clear();
+    if (use)
+      m_matcher.updateLikelihoodField(it->field, it->map);
+  }
+  if (m_infoStream)
+    m_infoStream << " -likelihoodField " << m_useLikelihoodField << endl;
+}
+
+void GridSlamProcessor::resetPyramids()
+{
+  for (ParticleVector::iterator it = m_particles.begin(); it != m_particles.end(); it++) {
+    it->pyramid.clear();
+    if (pyramidLevels())
+      m_matcher.updateMapPyramid(it->pyramid, it->map, pyramidLevels());
+  }
+}
+
+void GridSlamProcessor::setmultiResolutionLevels(unsigned int levels)
+{
+  m_multiResolutionLevels = levels;
+  resetPyramids();
+  if (m_infoStream)
+    m_infoStream << " -multiResolutionLevels " << m_multiResolutionLevels << endl;
+}
+
+void GridSlamProcessor::setuseCorrelativeMatching(bool use)
+{
+  m_useCorrelativeMatching = use;
+  resetPyramids();
+  if (m_infoStream)
+    m_infoStream << " -correlativeMatching " << m_useCorrelativeMatching << endl;
+}
+
 void GridSlamProcessor::setMotionModelParameters
 (double srr, double srt, double str, double stt)
 {
@@ -228,6 +332,14 @@ void GridSlamProcessor::setMotionModelParameters
 
 }
 
+void GridSlamProcessor::setMotionModelSeed(unsigned long seed)
+{
+  m_motionSeed = seed;
+  m_motionSamplers.clear();
+  if (m_infoStream)
+    m_infoStream << " -motionSeed " << seed << endl;
+}
+
 void GridSlamProcessor::setUpdateDistances(double linear, double angular, double resampleThreshold)
 {
   m_linearThresholdDistance = linear;
@@ -239,6 +351,24 @@ void GridSlamProcessor::setUpdateDistances(double linear, double angular, double
         << " -resampleThreshold " << m_resampleThreshold << endl;
 }
 
+void GridSlamProcessor::setResamplingParameters(ResamplingScheme scheme, unsigned long seed)
+{
+  m_resampler.setScheme(scheme);
+  m_resampler.seed(seed);
+  if (m_infoStream)
+    m_infoStream << " -resampling " << scheme
+        << " -seed " << seed << endl;
+}
+
+void GridSlamProcessor::setReadingEncoding(RangeBuffer::Encoding encoding, double resolution)
+{
+  m_readingEncoding = encoding;
+  m_readingResolution = resolution;
+  if (m_infoStream)
+    m_infoStream << " -readingEncoding " << encoding
+        << " -readingResolution " << resolution << endl;
+}
+
 //HERE STARTS THE BEEF
 
 GridSlamProcessor::Particle::Particle(const ScanMatcherMap& m) :
@@ -247,6 +377,25 @@ GridSlamProcessor::Particle::Particle(const ScanMatcherMap& m) :
   node = 0;
 }
 
+void GridSlamProcessor::Particle::swap(Particle& p)
+{
+  map.swap(p.map);
+  field.swap(p.field);
+  pyramid.swap(p.pyramid);
+  std::swap(pose, p.pose);
+  std::swap(previousPose, p.previousPose);
+  std::swap(weight, p.weight);
+  std::swap(weightSum, p.weightSum);
+  std::swap(gweight, p.gweight);
+  std::swap(previousIndex, p.previousIndex);
+  std::swap(node, p.node);
+}
+
+size_t GridSlamProcessor::Particle::getCopyBytes() const
+{
+  return sizeof(Particle) + map.storage().getTableBytes() + field.getTableBytes() + pyramid.getTableBytes();
+}
+
 void GridSlamProcessor::setSensorMap(const SensorMap& smap)
 {
 
@@ -307,6 +456,8 @@ void GridSlamProcessor::init(unsigned int size, double xmin, double ymin, double
     m_particles.back().node = node;
   }
   m_neff = (double)size;
+  m_poseEntropy = log((double)size);
+  m_resampleCopyBytes = 0;
   m_count = 0;
   m_readingCount = 0;
   m_linearDistance = m_angularDistance = 0;
@@ -323,19 +474,29 @@ void GridSlamProcessor::processTruePos(const OdometryReading& o)
 }
 
 bool GridSlamProcessor::processScan(const RangeReading & reading, int adaptParticles)
+{
+  //the scan matcher works on the reading in place, the tree gets a copy of it if the scan is processed
+  assert(reading.size() == m_beams);
+  return processRanges(RangeBufferPtr(), &(reading[0]), reading.getPose(), reading.getTime(), adaptParticles);
+}
+
+bool GridSlamProcessor::processScan(const RangeBufferPtr& ranges, const OrientedPoint& pose, double time, int adaptParticles)
+{
+  assert(ranges && (*ranges).size() == m_beams);
+  return processRanges(ranges, 0, pose, time, adaptParticles);
+}
+
+bool GridSlamProcessor::processRanges(RangeBufferPtr ranges, const double* plainReading, const OrientedPoint& pose, double time, int adaptParticles)
 {
 
   /**retireve the position from the reading, and compute the odometry*/
-  OrientedPoint relPose = reading.getPose();
+  OrientedPoint relPose = pose;
   if (!m_count) {
     m_lastPartPose = m_odoPose = relPose;
   }
 
   //write the state of the reading and update all the particles using the motion model
-  for (ParticleVector::iterator it = m_particles.begin(); it != m_particles.end(); it++) {
-    OrientedPoint& pose(it->pose);
-    pose = m_motionModel.drawFromMotion(it->pose, relPose, m_odoPose);
-  }
+  drawFromMotion(relPose, m_odoPose);
 
   // update the output file
   if (m_outputStream.is_open()) {
@@ -343,7 +504,7 @@ bool GridSlamProcessor::processScan(const RangeReading & reading, int adaptParti
     m_outputStream << "ODOM ";
     m_outputStream << setiosflags(ios::fixed) << setprecision(3) << m_odoPose.x << " " << m_odoPose.y << " ";
     m_outputStream << setiosflags(ios::fixed) << setprecision(6) << m_odoPose.theta << " ";
-    m_outputStream << reading.getTime();
+    m_outputStream << time;
     m_outputStream << endl;
   }
   if (m_outputStream.is_open()) {
@@ -354,7 +515,7 @@ bool GridSlamProcessor::processScan(const RangeReading & reading, int adaptParti
       m_outputStream << setiosflags(ios::fixed) << setprecision(3) << pose.x << " " << pose.y << " ";
       m_outputStream << setiosflags(ios::fixed) << setprecision(6) << pose.theta << " " << it->weight << " ";
     }
-    m_outputStream << reading.getTime();
+    m_outputStream << time;
     m_outputStream << endl;
   }
 
@@ -391,8 +552,8 @@ bool GridSlamProcessor::processScan(const RangeReading & reading, int adaptParti
   if (!m_count
       || m_linearDistance >= m_linearThresholdDistance
       || m_angularDistance >= m_angularThresholdDistance
-      || (period_ >= 0.0 && (reading.getTime() - last_update_time_) > period_)) {
-    last_update_time_ = reading.getTime();
+      || (period_ >= 0.0 && (time - last_update_time_) > period_)) {
+    last_update_time_ = time;
 
     if (m_outputStream.is_open()) {
       m_outputStream << setiosflags(ios::fixed) << setprecision(6);
@@ -405,34 +566,29 @@ bool GridSlamProcessor::processScan(const RangeReading & reading, int adaptParti
       m_infoStream << "update frame " << m_readingCount << endl
           << "update ld=" << m_linearDistance << " ad=" << m_angularDistance << endl;
 
-    cerr << "Laser Pose= " << reading.getPose().x << " " << reading.getPose().y
-        << " " << reading.getPose().theta << endl;
+    cerr << "Laser Pose= " << pose.x << " " << pose.y
+        << " " << pose.theta << endl;
 
-    //this is for converting the reading in a scan-matcher feedable form
-    assert(reading.size() == m_beams);
-    double * plainReading = new double[m_beams];
-    for (unsigned int i = 0; i < m_beams; i++) {
-      plainReading[i] = reading[i];
-    }
     m_infoStream << "m_count " << m_count << endl;
 
-    RangeReading* reading_copy =
-        new RangeReading(reading.size(),
-                         &(reading[0]),
-                         static_cast<const RangeSensor*>(reading.getSensor()),
-                         reading.getTime());
+    if (!plainReading) {
+      m_plainReading.resize(m_beams);
+      (*ranges).decode(&m_plainReading[0]);
+      plainReading = &m_plainReading[0];
+    }
+    if (!ranges)
+      ranges = RangeBufferPtr(new RangeBuffer(plainReading, m_beams, m_readingEncoding, m_readingResolution));
 
     if (m_count > 0) {
       scanMatch(plainReading);
       if (m_outputStream.is_open()) {
-        m_outputStream << "LASER_READING " << reading.size() << " ";
+        m_outputStream << "LASER_READING " << m_beams << " ";
         m_outputStream << setiosflags(ios::fixed) << setprecision(2);
-        for (RangeReading::const_iterator b = reading.begin(); b != reading.end(); b++) {
-          m_outputStream << *b << " ";
+        for (unsigned int i = 0; i < m_beams; i++) {
+          m_outputStream << plainReading[i] << " ";
         }
-        OrientedPoint p = reading.getPose();
         m_outputStream << setiosflags(ios::fixed) << setprecision(6);
-        m_outputStream << p.x << " " << p.y << " " << p.theta << " " << reading.getTime() << endl;
+        m_outputStream << pose.x << " " << pose.y << " " << pose.theta << " " << time << endl;
         m_outputStream << "SM_UPDATE " << m_particles.size() << " ";
         for (ParticleVector::const_iterator it = m_particles.begin(); it != m_particles.end(); it++) {
           const OrientedPoint& pose = it->pose;
@@ -452,20 +608,21 @@ bool GridSlamProcessor::processScan(const RangeReading & reading, int adaptParti
         m_outputStream << setiosflags(ios::fixed) << setprecision(6);
         m_outputStream << "NEFF " << m_neff << endl;
       }
-      resample(plainReading, adaptParticles, reading_copy);
+      resample(plainReading, adaptParticles, ranges);
 
     }
     else {
       m_infoStream << "Registering First Scan" << endl;
       for (ParticleVector::iterator it = m_particles.begin(); it != m_particles.end(); it++) {
-        m_matcher.invalidateActiveArea();
-        m_matcher.computeActiveArea(it->map, it->pose, plainReading);
-        m_matcher.registerScan(it->map, it->pose, plainReading);
+        m_matcher.registerScanSinglePass(it->map, it->pose, plainReading);
+        if (m_useLikelihoodField)
+          m_matcher.updateLikelihoodField(it->field, it->map);
+        if (pyramidLevels())
+          m_matcher.updateMapPyramid(it->pyramid, it->map, pyramidLevels());
 
         // cyr: not needed anymore, particles refer to the root in the beginning!
         TNode* node = new TNode(it->pose, 0., it->node, 0);
-        //node->reading=0;
-        node->reading = reading_copy;
+        node->reading = ranges;
         it->node = node;
 
       }
@@ -474,7 +631,6 @@ bool GridSlamProcessor::processScan(const RangeReading & reading, int adaptParti
     updateTreeWeights(false);
     //		cerr  << ".done!" <<endl;
 
-    delete[] plainReading;
     m_lastPartPose = m_odoPose; //update the past pose for the next iteration
     m_linearDistance = 0;
     m_angularDistance = 0;
@@ -18,20 +18,50 @@ GridSlamProcessor::TNode::TNode(const OrientedPoint& p, double w, TNode* n, unsi
 	weight=w;
 	childs=c;
 	parent=n;
-	reading=0;
 	gweight=0;
 	if (n){
 		n->childs++;
 	}
 	flag=0;
 	accWeight=0;
+	visitCounter=0;
 }
 
 
 GridSlamProcessor::TNode::~TNode(){
-	if (parent && (--parent->childs)<=0)
-		delete parent;
 	assert(!childs);
+	//the ancestors left without childs are deleted here rather than by their own destructors,
+	//which would recurse as deep as the dead branch is long
+	TNode* n=parent;
+	while (n && !--n->childs){
+		TNode* p=n->parent;
+		n->parent=0;
+		delete n;
+		n=p;
+	}
+}
+
+static SlabAllocator& nodeAllocator(){
+	//never destroyed: nodes may still be released by static objects at exit
+	static SlabAllocator* allocator=new SlabAllocator(sizeof(GridSlamProcessor::TNode), 4096, sizeof(double));
+	return *allocator;
+}
+
+void* GridSlamProcessor::TNode::operator new(size_t size){
+	if (size!=sizeof(TNode))
+		return ::operator new(size);
+	return nodeAllocator().allocate();
+}
+
+void GridSlamProcessor::TNode::operator delete(void* node, size_t size){
+	if (size!=sizeof(TNode))
+		::operator delete(node);
+	else
+		nodeAllocator().deallocate(node);
+}
+
+SlabAllocator::Statistics GridSlamProcessor::TNode::poolStatistics(){
+	return nodeAllocator().statistics();
 }
 
 
@@ -153,8 +183,7 @@ void GridSlamProcessor::integrateScanSequence(GridSlamProcessor::TNode* node){
 		
 		
 		double * plainReading = new double[m_beams];
-		for(unsigned int i=0; i<m_beams; i++)
-			plainReading[i]=(*(aux->reading))[i];
+		(*(aux->reading)).decode(plainReading);
 		
 		for (ParticleVector::iterator it=m_particles.begin(); it!=m_particles.end(); it++){
 			//compute the position relative to the path;
@@ -218,16 +247,16 @@ void GridSlamProcessor::resetTree(){
 }
 
 double propagateWeight(GridSlamProcessor::TNode* n, double weight){
-	if (!n)
-		return weight;
-	double w=0;
-	n->visitCounter++;
-	n->accWeight+=weight;
-	if (n->visitCounter==n->childs){
-		w=propagateWeight(n->parent,n->accWeight);
+	//a node passes its weight on once all its childs did
+	for (; n; n=n->parent){
+		n->visitCounter++;
+		n->accWeight+=weight;
+		assert(n->visitCounter<=n->childs);
+		if (n->visitCounter!=n->childs)
+			return 0;
+		weight=n->accWeight;
 	}
-	assert(n->visitCounter<=n->childs);
-	return w;
+	return weight;
 }
 
 double GridSlamProcessor::propagateWeights(){
@@ -29,8 +29,8 @@
 #include <deque>
 #include <fstream>
 #include <iostream>
-#include <log/carmenconfiguration.h>
-#include <log/sensorstream.h>
+#include <gmapping/log/carmenconfiguration.h>
+#include <gmapping/log/sensorstream.h>
 #include <gridfastslam/gridslamprocessor.h>
 
 using namespace std;
@@ -2,6 +2,7 @@
 #define ARRAY2D_H
 
 #include <assert.h>
+#include <algorithm>
 #include <gmapping/utils/point.h>
 #include "accessstate.h"
 
@@ -17,6 +18,8 @@ template<class Cell, const bool debug=false> class Array2D{
 		~Array2D();
 		void clear();
 		void resize(int xmin, int ymin, int xmax, int ymax);
+		/**exchanges the cells with the ones of another array, without copying them*/
+		inline void swap(Array2D& g);
 		
 		
 		inline bool isInside(int x, int y) const;
@@ -160,6 +163,13 @@ void Array2D<Cell,debug>::resize(int xmin, int ymin, int xmax, int ymax){
 	this->m_ysize=ysize; 
 }
 
+template <class Cell, const bool debug>
+inline void Array2D<Cell,debug>::swap(Array2D<Cell,debug>& g){
+	std::swap(m_cells, g.m_cells);
+	std::swap(m_xsize, g.m_xsize);
+	std::swap(m_ysize, g.m_ysize);
+}
+
 template <class Cell, const bool debug>
 inline bool Array2D<Cell,debug>::isInside(int x, int y) const{
 	return x>=0 && y>=0 && x<m_xsize && y<m_ysize; 
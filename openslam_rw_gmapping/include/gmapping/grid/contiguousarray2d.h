@@ -0,0 +1,198 @@
+#ifndef CONTIGUOUSARRAY2D_H
+#define CONTIGUOUSARRAY2D_H
+
+#include <assert.h>
+#include <stdlib.h>
+#include <new>
+#include <gmapping/utils/point.h>
+#include "accessstate.h"
+
+namespace GMapping {
+
+/**A 2D array with the same interface of Array2D, whose cells live in a single buffer aligned
+to a cache line instead of in one separately allocated array per column.
+A cell is reached with a single indirection and a copy costs a single allocation.
+The cells of a column are contiguous, as in Array2D.
+The buffer can also be provided by the caller, which keeps its ownership; this is how
+the patches of a HierarchicalArray2D are placed in the blocks of a PatchPool.*/
+template<class Cell> class ContiguousArray2D{
+	public:
+		enum {Alignment=64};
+
+		ContiguousArray2D(int xsize=0, int ysize=0);
+		ContiguousArray2D& operator=(const ContiguousArray2D &);
+		ContiguousArray2D(const ContiguousArray2D<Cell> &);
+		/**constructors building the cells in a buffer of xsize*ysize cells owned by the caller*/
+		ContiguousArray2D(int xsize, int ysize, Cell* buffer);
+		ContiguousArray2D(const ContiguousArray2D<Cell> &, Cell* buffer);
+		~ContiguousArray2D();
+		void clear();
+		void resize(int xmin, int ymin, int xmax, int ymax);
+
+		inline bool isInside(int x, int y) const;
+		inline const Cell& cell(int x, int y) const;
+		inline Cell& cell(int x, int y);
+		inline AccessibilityState cellState(int x, int y) const { return (AccessibilityState) (isInside(x,y)?(Inside|Allocated):Outside);}
+
+		inline bool isInside(const IntPoint& p) const { return isInside(p.x, p.y);}
+		inline const Cell& cell(const IntPoint& p) const {return cell(p.x,p.y);}
+		inline Cell& cell(const IntPoint& p) {return cell(p.x,p.y);}
+		inline AccessibilityState cellState(const IntPoint& p) const { return cellState(p.x, p.y);}
+
+		inline int getPatchSize() const{return 0;}
+		inline int getPatchMagnitude() const{return 0;}
+		inline int getXSize() const {return m_xsize;}
+		inline int getYSize() const {return m_ysize;}
+		/**@returns the buffer of the cells, the cell (x,y) is at x*getYSize()+y*/
+		inline Cell* data() {return m_data;}
+		inline const Cell* data() const {return m_data;}
+	protected:
+		static Cell* allocate(int size);
+		static void deallocate(Cell* data, int size);
+		Cell* m_data;
+		int m_xsize, m_ysize;
+		bool m_ownsData;
+};
+
+template <class Cell>
+Cell* ContiguousArray2D<Cell>::allocate(int size){
+	void* buffer=0;
+	if (posix_memalign(&buffer, Alignment, sizeof(Cell)*size))
+		throw std::bad_alloc();
+	return static_cast<Cell*>(buffer);
+}
+
+template <class Cell>
+void ContiguousArray2D<Cell>::deallocate(Cell* data, int size){
+	for (int i=0; i<size; i++)
+		data[i].~Cell();
+	free(data);
+}
+
+template <class Cell>
+ContiguousArray2D<Cell>::ContiguousArray2D(int xsize, int ysize){
+	m_xsize=xsize;
+	m_ysize=ysize;
+	m_data=0;
+	m_ownsData=true;
+	if (m_xsize>0 && m_ysize>0){
+		m_data=allocate(m_xsize*m_ysize);
+		for (int i=0; i<m_xsize*m_ysize; i++)
+			new (m_data+i) Cell;
+	}
+	else{
+		m_xsize=m_ysize=0;
+	}
+}
+
+template <class Cell>
+ContiguousArray2D<Cell>::ContiguousArray2D(const ContiguousArray2D<Cell> & g){
+	m_xsize=g.m_xsize;
+	m_ysize=g.m_ysize;
+	m_data=0;
+	m_ownsData=true;
+	if (m_xsize>0 && m_ysize>0){
+		m_data=allocate(m_xsize*m_ysize);
+		for (int i=0; i<m_xsize*m_ysize; i++)
+			new (m_data+i) Cell(g.m_data[i]);
+	}
+}
+
+template <class Cell>
+ContiguousArray2D<Cell>::ContiguousArray2D(int xsize, int ysize, Cell* buffer){
+	m_xsize=xsize;
+	m_ysize=ysize;
+	m_data=buffer;
+	m_ownsData=false;
+	for (int i=0; i<m_xsize*m_ysize; i++)
+		new (m_data+i) Cell;
+}
+
+template <class Cell>
+ContiguousArray2D<Cell>::ContiguousArray2D(const ContiguousArray2D<Cell> & g, Cell* buffer){
+	m_xsize=g.m_xsize;
+	m_ysize=g.m_ysize;
+	m_data=buffer;
+	m_ownsData=false;
+	for (int i=0; i<m_xsize*m_ysize; i++)
+		new (m_data+i) Cell(g.m_data[i]);
+}
+
+template <class Cell>
+ContiguousArray2D<Cell> & ContiguousArray2D<Cell>::operator=(const ContiguousArray2D<Cell> & g){
+	if (this==&g)
+		return *this;
+	if (m_xsize*m_ysize!=g.m_xsize*g.m_ysize){
+		ContiguousArray2D<Cell> copy(g);
+		clear();
+		m_data=copy.m_data;
+		m_ownsData=true;
+		m_xsize=copy.m_xsize;
+		m_ysize=copy.m_ysize;
+		copy.m_data=0;
+		copy.m_xsize=copy.m_ysize=0;
+		return *this;
+	}
+	m_xsize=g.m_xsize;
+	m_ysize=g.m_ysize;
+	for (int i=0; i<m_xsize*m_ysize; i++)
+		m_data[i]=g.m_data[i];
+	return *this;
+}
+
+template <class Cell>
+ContiguousArray2D<Cell>::~ContiguousArray2D(){
+	clear();
+}
+
+template <class Cell>
+void ContiguousArray2D<Cell>::clear(){
+	if (m_data && m_ownsData)
+		deallocate(m_data, m_xsize*m_ysize);
+	else
+		for (int i=0; i<m_xsize*m_ysize; i++)
+			m_data[i].~Cell();
+	m_data=0;
+	m_xsize=0;
+	m_ysize=0;
+}
+
+template <class Cell>
+void ContiguousArray2D<Cell>::resize(int xmin, int ymin, int xmax, int ymax){
+	ContiguousArray2D<Cell> resized(xmax-xmin, ymax-ymin);
+	int dx= xmin < 0 ? 0 : xmin;
+	int dy= ymin < 0 ? 0 : ymin;
+	int Dx=xmax<this->m_xsize?xmax:this->m_xsize;
+	int Dy=ymax<this->m_ysize?ymax:this->m_ysize;
+	for (int x=dx; x<Dx; x++)
+		for (int y=dy; y<Dy; y++)
+			resized.m_data[(x-xmin)*resized.m_ysize+y-ymin]=m_data[x*m_ysize+y];
+	clear();
+	m_data=resized.m_data;
+	m_ownsData=true;
+	m_xsize=resized.m_xsize;
+	m_ysize=resized.m_ysize;
+	resized.m_data=0;
+	resized.m_xsize=resized.m_ysize=0;
+}
+
+template <class Cell>
+inline bool ContiguousArray2D<Cell>::isInside(int x, int y) const{
+	return x>=0 && y>=0 && x<m_xsize && y<m_ysize;
+}
+
+template <class Cell>
+inline const Cell& ContiguousArray2D<Cell>::cell(int x, int y) const{
+	assert(isInside(x,y));
+	return m_data[x*m_ysize+y];
+}
+
+template <class Cell>
+inline Cell& ContiguousArray2D<Cell>::cell(int x, int y){
+	assert(isInside(x,y));
+	return m_data[x*m_ysize+y];
+}
+
+};
+
+#endif
@@ -1,21 +1,64 @@
 #ifndef HARRAY2D_H
 #define HARRAY2D_H
 #include <set>
+#include <vector>
+#include <algorithm>
+#include <iterator>
 #include <gmapping/utils/point.h>
 #include <gmapping/utils/autoptr.h>
 #include "array2d.h"
+#include "contiguousarray2d.h"
+#include "patchpool.h"
 
 namespace GMapping {
 
 template <class Cell>
-class HierarchicalArray2D: public Array2D<autoptr< Array2D<Cell> > >{
+class HierarchicalArray2D: public Array2D<atomic_autoptr< ContiguousArray2D<Cell> > >{
 	public:
 		typedef std::set< point<int>, pointcomparator<int> > PointSet;
+		/**a set of points stored as a vector sorted with pointcomparator, without duplicates*/
+		typedef std::vector< point<int> > PointList;
+		/**a patch stores its cells in a single buffer, patches are shared between copies of the array.
+		The copies can be made and destroyed concurrently, since the shares are counted atomically.*/
+		typedef ContiguousArray2D<Cell> Patch;
+		typedef atomic_autoptr<Patch> PatchPtr;
+		typedef PatchPool<Cell> Pool;
+		/**the memory taken by the patches of one or more arrays*/
+		struct Statistics{
+			/**patches allocated*/
+			unsigned int patches;
+			/**patches referenced by other arrays as well*/
+			unsigned int shared;
+			/**bytes of the patches, the shared ones included*/
+			size_t patchBytes;
+			/**bytes of the patches not shared, which go away with the array*/
+			size_t uniqueBytes;
+			/**bytes of the tables of patch pointers*/
+			size_t tableBytes;
+			Statistics(): patches(0), shared(0), patchBytes(0), uniqueBytes(0), tableBytes(0){}
+			inline size_t bytes() const {return patchBytes+tableBytes;}
+		};
 		HierarchicalArray2D(int xsize, int ysize, int patchMagnitude=5);
 		HierarchicalArray2D(const HierarchicalArray2D& hg);
 		HierarchicalArray2D& operator=(const HierarchicalArray2D& hg);
 		virtual ~HierarchicalArray2D(){}
+		/**changes the area covered to the patches [ixmin, ixmax) x [iymin, iymax), releasing the ones falling out of it.
+		If the size does not change the area is scrolled in place.*/
 		void resize(int ixmin, int iymin, int ixmax, int iymax);
+		/**moves the area covered by dx columns and dy rows of patches, so that the patch (x,y) becomes (x-dx,y-dy).
+		The table of patches is used as a ring buffer: it is rotated in place, the patches leaving the area are
+		released and the slots they leave wrap around to the entering side, empty. No patch is copied and the
+		table is not reallocated.*/
+		void scroll(int dx, int dy);
+		/**exchanges the patches and the active area with the ones of another array, without touching the shares*/
+		inline void swap(HierarchicalArray2D& hg);
+		/**@returns the bytes of the table of patch pointers, which is what a copy of the array duplicates*/
+		inline size_t getTableBytes() const {return sizeof(PatchPtr)*this->m_xsize*this->m_ysize;}
+		/**@returns the bytes of a patch and its cells*/
+		inline size_t getPatchBytes() const {return sizeof(Patch)+sizeof(Cell)*m_patchSize*m_patchSize;}
+		/**@returns the memory taken by the patches of the array, the shared ones being those
+		referenced by any other array, or by anything else holding a patch pointer*/
+		Statistics patchStatistics() const;
 		inline int getPatchSize() const {return m_patchMagnitude;}
 		inline int getPatchMagnitude() const {return m_patchMagnitude;}
 		
@@ -32,47 +75,74 @@ class HierarchicalArray2D: public Array2D<autoptr< Array2D<Cell> > >{
 		inline IntPoint patchIndexes(const IntPoint& p) const { return patchIndexes(p.x,p.y);}
 		
 		inline void setActiveArea(const PointSet&, bool patchCoords=false);
-		const PointSet& getActiveArea() const {return m_activeArea; }
+		/**sets the active area from a list of points, which must be sorted and without duplicates when they are patch coordinates*/
+		inline void setActiveArea(const PointList&, bool patchCoords=false);
+		const PointList& getActiveArea() const {return m_activeArea; }
+		/**sorts the list and removes the duplicates, turning it into a valid PointList*/
+		static inline void makeUnique(PointList& l);
 		inline void allocActiveArea();
+		/**turns on or off the tracking of the patches written, which is off in a new array and in a copy.
+		Turning it off, or assigning another array, drops the patches tracked so far.*/
+		inline void setTrackDirtyArea(bool track);
+		inline bool getTrackDirtyArea() const {return m_trackDirtyArea;}
+		/**adds the patches of a sorted patch list to the ones written since the last takeDirtyArea(), if tracked.
+		The tracked patches follow the resizes and scrolls of the array, the ones falling out of it being dropped.*/
+		inline void addDirtyArea(const PointList& patches);
+		/**moves the patches written since the last call, sorted and without duplicates, to the given list*/
+		inline void takeDirtyArea(PointList& patches);
+		/**@returns the patch with patch coordinates p, ready to be changed without affecting the copies
+		of this array: it is allocated if missing and copied if shared. Unlike allocActiveArea(),
+		a patch referenced only by this array is not copied.*/
+		inline Patch& writablePatch(const IntPoint& p);
 	protected:
-		virtual Array2D<Cell> * createPatch(const IntPoint& p) const;
-		PointSet m_activeArea;
+		virtual PatchPtr createPatch(const IntPoint& p) const;
+		virtual PatchPtr clonePatch(const Patch& patch) const;
+		void shiftDirtyArea(int dx, int dy);
+		PointList m_activeArea;
+		PointList m_dirtyArea;
+		bool m_trackDirtyArea;
 		int m_patchMagnitude;
 		int m_patchSize;
 };
 
 template <class Cell>
 HierarchicalArray2D<Cell>::HierarchicalArray2D(int xsize, int ysize, int patchMagnitude) 
-  :Array2D<autoptr< Array2D<Cell> > >::Array2D((xsize>>patchMagnitude), (ysize>>patchMagnitude)){
+  :Array2D<atomic_autoptr< ContiguousArray2D<Cell> > >::Array2D((xsize>>patchMagnitude), (ysize>>patchMagnitude)){
 	m_patchMagnitude=patchMagnitude;
 	m_patchSize=1<<m_patchMagnitude;
+	m_trackDirtyArea=false;
 }
 
 template <class Cell>
 HierarchicalArray2D<Cell>::HierarchicalArray2D(const HierarchicalArray2D& hg)
-  :Array2D<autoptr< Array2D<Cell> > >::Array2D((hg.m_xsize>>hg.m_patchMagnitude), (hg.m_ysize>>hg.m_patchMagnitude))  // added by cyrill: if you have a resize error, check this again
+  :Array2D<atomic_autoptr< ContiguousArray2D<Cell> > >::Array2D((hg.m_xsize>>hg.m_patchMagnitude), (hg.m_ysize>>hg.m_patchMagnitude))  // added by cyrill: if you have a resize error, check this again
 {
 	this->m_xsize=hg.m_xsize;
 	this->m_ysize=hg.m_ysize;
-	this->m_cells=new autoptr< Array2D<Cell> >*[this->m_xsize];
+	this->m_cells=new PatchPtr*[this->m_xsize];
 	for (int x=0; x<this->m_xsize; x++){
-		this->m_cells[x]=new autoptr< Array2D<Cell> >[this->m_ysize];
+		this->m_cells[x]=new PatchPtr[this->m_ysize];
 		for (int y=0; y<this->m_ysize; y++)
 			this->m_cells[x][y]=hg.m_cells[x][y];
 	}
 	this->m_patchMagnitude=hg.m_patchMagnitude;
 	this->m_patchSize=hg.m_patchSize;
+	this->m_trackDirtyArea=false;
 }
 
 template <class Cell>
 void HierarchicalArray2D<Cell>::resize(int xmin, int ymin, int xmax, int ymax){
 	int xsize=xmax-xmin;
 	int ysize=ymax-ymin;
-	autoptr< Array2D<Cell> > ** newcells=new autoptr< Array2D<Cell> > *[xsize];
+	if (xsize==this->m_xsize && ysize==this->m_ysize){
+		scroll(xmin, ymin);
+		return;
+	}
+	PatchPtr ** newcells=new PatchPtr *[xsize];
 	for (int x=0; x<xsize; x++){
-		newcells[x]=new autoptr< Array2D<Cell> >[ysize];
+		newcells[x]=new PatchPtr[ysize];
 		for (int y=0; y<ysize; y++){
-			newcells[x][y]=autoptr< Array2D<Cell> >(0);
+			newcells[x][y]=PatchPtr(0);
 		}
 	}
 	int dx= xmin < 0 ? 0 : xmin;
@@ -81,34 +151,100 @@ void HierarchicalArray2D<Cell>::resize(int xmin, int ymin, int xmax, int ymax){
 	int Dy=ymax<this->m_ysize?ymax:this->m_ysize;
 	for (int x=dx; x<Dx; x++){
 		for (int y=dy; y<Dy; y++){
-			newcells[x-xmin][y-ymin]=this->m_cells[x][y];
+			newcells[x-xmin][y-ymin].swap(this->m_cells[x][y]);
 		}
-		delete [] this->m_cells[x];
 	}
+	//the patches falling out of the new area are released here
+	for (int x=0; x<this->m_xsize; x++)
+		delete [] this->m_cells[x];
 	delete [] this->m_cells;
 	this->m_cells=newcells;
 	this->m_xsize=xsize;
 	this->m_ysize=ysize; 
+	shiftDirtyArea(xmin, ymin);
+}
+
+template <class Cell>
+void HierarchicalArray2D<Cell>::scroll(int dx, int dy){
+	int xsize=this->m_xsize, ysize=this->m_ysize;
+	if (!dx && !dy)
+		return;
+	shiftDirtyArea(dx, dy);
+	//the patches leaving the area: the columns x-dx and the rows y-dy out of the table
+	for (int x=0; x<xsize; x++){
+		bool column=x-dx<0 || x-dx>=xsize;
+		for (int y=0; y<ysize; y++)
+			if (column || y-dy<0 || y-dy>=ysize)
+				this->m_cells[x][y]=PatchPtr(0);
+	}
+	if (dx>=xsize || dx<=-xsize || dy>=ysize || dy<=-ysize)
+		return;
+	if (dx)
+		std::rotate(this->m_cells, this->m_cells+(dx>0?dx:dx+xsize), this->m_cells+xsize);
+	if (dy)
+		for (int x=0; x<xsize; x++)
+			std::rotate(this->m_cells[x], this->m_cells[x]+(dy>0?dy:dy+ysize), this->m_cells[x]+ysize);
+}
+
+template <class Cell>
+void HierarchicalArray2D<Cell>::shiftDirtyArea(int dx, int dy){
+	//the order is kept by a translation, only the patches out of the array go
+	typename PointList::iterator last=m_dirtyArea.begin();
+	for (typename PointList::const_iterator it=m_dirtyArea.begin(); it!=m_dirtyArea.end(); ++it){
+		IntPoint p(it->x-dx, it->y-dy);
+		if (this->isInside(p))
+			*last++=p;
+	}
+	m_dirtyArea.erase(last, m_dirtyArea.end());
+}
+
+template <class Cell>
+void HierarchicalArray2D<Cell>::swap(HierarchicalArray2D& hg){
+	Array2D<PatchPtr>::swap(hg);
+	m_activeArea.swap(hg.m_activeArea);
+	m_dirtyArea.swap(hg.m_dirtyArea);
+	std::swap(m_trackDirtyArea, hg.m_trackDirtyArea);
+	std::swap(m_patchMagnitude, hg.m_patchMagnitude);
+	std::swap(m_patchSize, hg.m_patchSize);
+}
+
+template <class Cell>
+typename HierarchicalArray2D<Cell>::Statistics HierarchicalArray2D<Cell>::patchStatistics() const{
+	Statistics s;
+	for (int x=0; x<this->m_xsize; x++)
+		for (int y=0; y<this->m_ysize; y++){
+			const PatchPtr& ptr=this->m_cells[x][y];
+			if (!ptr)
+				continue;
+			s.patches++;
+			if (!ptr.unique())
+				s.shared++;
+		}
+	s.patchBytes=s.patches*getPatchBytes();
+	s.uniqueBytes=(s.patches-s.shared)*getPatchBytes();
+	s.tableBytes=getTableBytes();
+	return s;
 }
 
 template <class Cell>
 HierarchicalArray2D<Cell>& HierarchicalArray2D<Cell>::operator=(const HierarchicalArray2D& hg){
-//	Array2D<autoptr< Array2D<Cell> > >::operator=(hg);
+//	Array2D<atomic_autoptr< ContiguousArray2D<Cell> > >::operator=(hg);
 	if (this->m_xsize!=hg.m_xsize || this->m_ysize!=hg.m_ysize){
 		for (int i=0; i<this->m_xsize; i++)
 			delete [] this->m_cells[i];
 		delete [] this->m_cells;
 		this->m_xsize=hg.m_xsize;
 		this->m_ysize=hg.m_ysize;
-		this->m_cells=new autoptr< Array2D<Cell> >*[this->m_xsize];
+		this->m_cells=new PatchPtr*[this->m_xsize];
 		for (int i=0; i<this->m_xsize; i++)
-			this->m_cells[i]=new autoptr< Array2D<Cell> > [this->m_ysize];
+			this->m_cells[i]=new PatchPtr [this->m_ysize];
 	}
 	for (int x=0; x<this->m_xsize; x++)
 		for (int y=0; y<this->m_ysize; y++)
 			this->m_cells[x][y]=hg.m_cells[x][y];
 	
 	m_activeArea.clear();
+	m_dirtyArea.clear();
 	m_patchMagnitude=hg.m_patchMagnitude;
 	m_patchSize=hg.m_patchSize;
 	return *this;
@@ -124,13 +260,42 @@ void HierarchicalArray2D<Cell>::setActiveArea(const typename HierarchicalArray2D
 			p=*it;
 		else
 			p=patchIndexes(*it);
-		m_activeArea.insert(p);
+		m_activeArea.push_back(p);
+	}
+	if (!patchCoords)
+		makeUnique(m_activeArea);
+}
+
+template <class Cell>
+void HierarchicalArray2D<Cell>::setActiveArea(const typename HierarchicalArray2D<Cell>::PointList& aa, bool patchCoords){
+	if (patchCoords){
+		m_activeArea=aa;
+		return;
 	}
+	m_activeArea.clear();
+	for (typename PointList::const_iterator it= aa.begin(); it!=aa.end(); ++it)
+		m_activeArea.push_back(patchIndexes(*it));
+	makeUnique(m_activeArea);
 }
 
 template <class Cell>
-Array2D<Cell>* HierarchicalArray2D<Cell>::createPatch(const IntPoint& ) const{
-	return new Array2D<Cell>(1<<m_patchMagnitude, 1<<m_patchMagnitude);
+void HierarchicalArray2D<Cell>::makeUnique(PointList& l){
+	std::sort(l.begin(), l.end(), pointcomparator<int>());
+	typename PointList::iterator last=l.begin();
+	for (typename PointList::const_iterator it=l.begin(); it!=l.end(); ++it)
+		if (last==l.begin() || (last-1)->x!=it->x || (last-1)->y!=it->y)
+			*last++=*it;
+	l.erase(last, l.end());
+}
+
+template <class Cell>
+typename HierarchicalArray2D<Cell>::PatchPtr HierarchicalArray2D<Cell>::createPatch(const IntPoint& ) const{
+	return Pool::instance().create(1<<m_patchMagnitude);
+}
+
+template <class Cell>
+typename HierarchicalArray2D<Cell>::PatchPtr HierarchicalArray2D<Cell>::clonePatch(const Patch& patch) const{
+	return Pool::instance().clone(patch);
 }
 
 
@@ -147,22 +312,54 @@ AccessibilityState  HierarchicalArray2D<Cell>::cellState(int x, int y) const {
 
 template <class Cell>
 void HierarchicalArray2D<Cell>::allocActiveArea(){
-	for (PointSet::const_iterator it= m_activeArea.begin(); it!=m_activeArea.end(); ++it){
-		const autoptr< Array2D<Cell> >& ptr=this->m_cells[it->x][it->y];
-		Array2D<Cell>* patch=0;
+	for (typename PointList::const_iterator it= m_activeArea.begin(); it!=m_activeArea.end(); ++it){
+		PatchPtr& ptr=this->m_cells[it->x][it->y];
 		if (!ptr){
-			patch=createPatch(*it);
+			ptr=createPatch(*it);
 		} else{	
-			patch=new Array2D<Cell>(*ptr);
+			ptr=clonePatch(*ptr);
 		}
-		this->m_cells[it->x][it->y]=autoptr< Array2D<Cell> >(patch);
 	}
 }
 
+template <class Cell>
+void HierarchicalArray2D<Cell>::setTrackDirtyArea(bool track){
+	m_trackDirtyArea=track;
+	if (!track)
+		PointList().swap(m_dirtyArea);
+}
+
+template <class Cell>
+void HierarchicalArray2D<Cell>::addDirtyArea(const PointList& patches){
+	if (!m_trackDirtyArea || patches.empty())
+		return;
+	PointList merged;
+	merged.reserve(m_dirtyArea.size()+patches.size());
+	std::set_union(m_dirtyArea.begin(), m_dirtyArea.end(), patches.begin(), patches.end(), std::back_inserter(merged), pointcomparator<int>());
+	m_dirtyArea.swap(merged);
+}
+
+template <class Cell>
+void HierarchicalArray2D<Cell>::takeDirtyArea(PointList& patches){
+	patches.clear();
+	patches.swap(m_dirtyArea);
+}
+
+template <class Cell>
+typename HierarchicalArray2D<Cell>::Patch& HierarchicalArray2D<Cell>::writablePatch(const IntPoint& p){
+	assert(this->isInside(p.x, p.y));
+	PatchPtr& ptr=this->m_cells[p.x][p.y];
+	if (!ptr)
+		ptr=createPatch(p);
+	else if (!ptr.unique())
+		ptr=clonePatch(*ptr);
+	return *ptr;
+}
+
 template <class Cell>
 bool HierarchicalArray2D<Cell>::isAllocated(int x, int y) const{
 	IntPoint c=patchIndexes(x,y);
-	autoptr< Array2D<Cell> >& ptr=this->m_cells[c.x][c.y];
+	PatchPtr& ptr=this->m_cells[c.x][c.y];
 	return (ptr != 0);
 }
 
@@ -178,11 +375,10 @@ Cell& HierarchicalArray2D<Cell>::cell(int x, int y){
 	IntPoint c=patchIndexes(x,y);
 	assert(this->isInside(c.x, c.y));
 	if (!this->m_cells[c.x][c.y]){
-		Array2D<Cell>* patch=createPatch(IntPoint(x,y));
-		this->m_cells[c.x][c.y]=autoptr< Array2D<Cell> >(patch);
+		this->m_cells[c.x][c.y]=createPatch(IntPoint(x,y));
 		//cerr << "!!! FATAL: your dick is going to fall down" << endl;
 	}
-	autoptr< Array2D<Cell> >& ptr=this->m_cells[c.x][c.y];
+	PatchPtr& ptr=this->m_cells[c.x][c.y];
 	return (*ptr).cell(IntPoint(x-(c.x<<m_patchMagnitude),y-(c.y<<m_patchMagnitude)));
 }
 
@@ -190,7 +386,7 @@ template <class Cell>
 const Cell& HierarchicalArray2D<Cell>::cell(int x, int y) const{
 	assert(isAllocated(x,y));
 	IntPoint c=patchIndexes(x,y);
-	const autoptr< Array2D<Cell> >& ptr=this->m_cells[c.x][c.y];
+	const PatchPtr& ptr=this->m_cells[c.x][c.y];
 	return (*ptr).cell(IntPoint(x-(c.x<<m_patchMagnitude),y-(c.y<<m_patchMagnitude)));
 }
 
@@ -4,13 +4,14 @@
 #include <assert.h>
 #include "accessstate.h"
 #include "array2d.h"
+#include "contiguousarray2d.h"
 
 namespace GMapping {
 /**
 The cells have to define the special value Cell::Unknown to handle with the unallocated areas.
 The cells have to define (int) constructor;
 */
-typedef Array2D<double> DoubleArray2D;
+typedef ContiguousArray2D<double> DoubleArray2D;
 
 template <class Cell, class Storage, const bool isClass=true> 
 class Map{
@@ -23,6 +24,8 @@ class Map{
 		//Map& operator =(const Map& g);
 		void resize(double xmin, double ymin, double xmax, double ymax);
 		void grow(double xmin, double ymin, double xmax, double ymax);
+		/**exchanges the content with another map, the storages are swapped and not copied*/
+		inline void swap(Map& m);
 		inline IntPoint world2map(const Point& p) const;
 		inline Point map2world(const IntPoint& p) const;
 		inline IntPoint world2map(double x, double y) const 
@@ -99,6 +102,19 @@ typedef Map<double, DoubleArray2D, false> DoubleMap;
 template <class Cell, class Storage, const bool isClass>
   const Cell  Map<Cell,Storage,isClass>::m_unknown = Cell(-1);
 
+template <class Cell, class Storage, const bool isClass>
+void Map<Cell,Storage,isClass>::swap(Map& m){
+	std::swap(m_center, m.m_center);
+	std::swap(m_worldSizeX, m.m_worldSizeX);
+	std::swap(m_worldSizeY, m.m_worldSizeY);
+	std::swap(m_delta, m.m_delta);
+	m_storage.swap(m.m_storage);
+	std::swap(m_mapSizeX, m.m_mapSizeX);
+	std::swap(m_mapSizeY, m.m_mapSizeY);
+	std::swap(m_sizeX2, m.m_sizeX2);
+	std::swap(m_sizeY2, m.m_sizeY2);
+}
+
 template <class Cell, class Storage, const bool isClass>
 Map<Cell,Storage,isClass>::Map(int mapSizeX, int mapSizeY, double delta):
 	m_storage(mapSizeX, mapSizeY){
@@ -0,0 +1,188 @@
+#ifndef PATCHPOOL_H
+#define PATCHPOOL_H
+
+#include <gmapping/utils/autoptr.h>
+#include <gmapping/utils/slaballocator.h>
+#include "contiguousarray2d.h"
+
+namespace GMapping {
+
+/**The allocator of the patches of the HierarchicalArray2D with a given cell type.
+A patch, its cells and the reference counter of the autoptr sharing it live in a single
+block of a SlabAllocator, so creating or copying a patch and releasing it do not go
+through the heap once the pool is warm.
+The blocks are handed out and given back under a lock, so patches can be created and
+released concurrently.
+The pool serves patches of the size requested the first time; patches of other sizes
+are allocated on the heap as usual. There is a single pool per cell type, shared by all
+the maps, since patches are shared between the maps of different particles.*/
+template <class Cell>
+class PatchPool{
+	public:
+		typedef ContiguousArray2D<Cell> Patch;
+		typedef atomic_autoptr<Patch> PatchPtr;
+		typedef SlabAllocator::Statistics Statistics;
+
+		static PatchPool& instance();
+
+		/**@returns a new patch of size x size default cells*/
+		PatchPtr create(int size);
+		/**@returns a new patch, copy of the given one*/
+		PatchPtr clone(const Patch& patch);
+
+		/**makes room for the given number of patches*/
+		void reserve(unsigned int patches);
+		/**changes the number of patches allocated at once when the pool is exhausted*/
+		void setPatchesPerSlab(unsigned int patches);
+
+		/**@returns the statistics of the pool, all zero if no patch has been served yet*/
+		Statistics statistics() const;
+		/**@returns the side of the patches served by the pool, 0 if not fixed yet*/
+		inline int patchSize() const {return m_size;}
+
+	protected:
+		struct Header{
+			typename PatchPtr::reference reference;
+			PatchPool* pool;
+		};
+		enum {PatchOffset=(sizeof(Header)+15)/16*16};
+		enum {CellOffset=(PatchOffset+sizeof(Patch)+SlabAllocator::Alignment-1)/SlabAllocator::Alignment*SlabAllocator::Alignment};
+
+		PatchPool();
+		~PatchPool();
+		bool serves(int size);
+		Header* block();
+		PatchPtr attach(Header* h, Patch* patch);
+		static void release(typename PatchPtr::reference* r);
+
+		inline void lock() const {while (__sync_lock_test_and_set(&m_lock, 1)) ;}
+		inline void unlock() const {__sync_lock_release(&m_lock);}
+		/**@returns the allocator, 0 until the first patch is served. The allocator is published
+		after the patch size, behind a barrier, so a thread seeing it without the lock also sees the size.*/
+		inline SlabAllocator* allocator() const {SlabAllocator* a=m_allocator; __sync_synchronize(); return a;}
+
+		SlabAllocator* m_allocator;
+		int m_size;
+		unsigned int m_reserve, m_patchesPerSlab;
+		mutable volatile int m_lock;
+
+	private:
+		PatchPool(const PatchPool&);
+		PatchPool& operator=(const PatchPool&);
+};
+
+template <class Cell>
+PatchPool<Cell>& PatchPool<Cell>::instance(){
+	static PatchPool<Cell> pool;
+	return pool;
+}
+
+template <class Cell>
+PatchPool<Cell>::PatchPool(){
+	m_allocator=0;
+	m_size=0;
+	m_reserve=0;
+	m_patchesPerSlab=256;
+	m_lock=0;
+}
+
+template <class Cell>
+PatchPool<Cell>::~PatchPool(){
+	//patches still alive at exit would be released into freed slabs: leave them to the os
+	if (m_allocator && !m_allocator->statistics().used)
+		delete m_allocator;
+}
+
+template <class Cell>
+bool PatchPool<Cell>::serves(int size){
+	if (allocator())
+		return size==m_size;
+	lock();
+	if (!m_allocator && size>0){
+		SlabAllocator* a=new SlabAllocator(CellOffset+sizeof(Cell)*size*size, m_patchesPerSlab);
+		if (m_reserve)
+			a->reserve(m_reserve);
+		m_size=size;
+		__sync_synchronize();
+		m_allocator=a;
+	}
+	unlock();
+	return size==m_size;
+}
+
+template <class Cell>
+typename PatchPool<Cell>::Header* PatchPool<Cell>::block(){
+	Header* h=static_cast<Header*>(m_allocator->allocate());
+	h->reference.shares=0;
+	h->reference.release=release;
+	h->pool=this;
+	return h;
+}
+
+template <class Cell>
+typename PatchPool<Cell>::PatchPtr PatchPool<Cell>::attach(Header* h, Patch* patch){
+	h->reference.data=patch;
+	return PatchPtr::attach(&h->reference);
+}
+
+template <class Cell>
+typename PatchPool<Cell>::PatchPtr PatchPool<Cell>::create(int size){
+	if (!serves(size))
+		return PatchPtr(new Patch(size, size));
+	Header* h=block();
+	char* base=reinterpret_cast<char*>(h);
+	Patch* patch=new (base+PatchOffset) Patch(size, size, reinterpret_cast<Cell*>(base+CellOffset));
+	return attach(h, patch);
+}
+
+template <class Cell>
+typename PatchPool<Cell>::PatchPtr PatchPool<Cell>::clone(const Patch& p){
+	if (p.getXSize()!=p.getYSize() || !serves(p.getXSize()))
+		return PatchPtr(new Patch(p));
+	Header* h=block();
+	char* base=reinterpret_cast<char*>(h);
+	Patch* patch=new (base+PatchOffset) Patch(p, reinterpret_cast<Cell*>(base+CellOffset));
+	return attach(h, patch);
+}
+
+template <class Cell>
+void PatchPool<Cell>::release(typename PatchPtr::reference* r){
+	Header* h=reinterpret_cast<Header*>(r);
+	r->data->~Patch();
+	h->pool->m_allocator->deallocate(h);
+}
+
+template <class Cell>
+void PatchPool<Cell>::reserve(unsigned int patches){
+	lock();
+	m_reserve=patches;
+	if (m_allocator)
+		m_allocator->reserve(patches);
+	unlock();
+}
+
+template <class Cell>
+void PatchPool<Cell>::setPatchesPerSlab(unsigned int patches){
+	lock();
+	m_patchesPerSlab=patches;
+	if (m_allocator)
+		m_allocator->setBlocksPerSlab(patches);
+	unlock();
+}
+
+template <class Cell>
+typename PatchPool<Cell>::Statistics PatchPool<Cell>::statistics() const{
+	SlabAllocator* a=allocator();
+	if (a)
+		return a->statistics();
+	Statistics s;
+	s.blockSize=0;
+	s.blocksPerSlab=m_patchesPerSlab;
+	s.slabs=s.capacity=s.used=s.peak=0;
+	s.allocations=s.recycled=0;
+	return s;
+}
+
+};
+
+#endif
@@ -9,9 +9,12 @@
 #include <gmapping/particlefilter/particlefilter.h>
 #include <gmapping/utils/point.h>
 #include <gmapping/utils/macro_params.h>
+#include <gmapping/utils/workerpool.h>
+#include <gmapping/utils/slaballocator.h>
 #include <gmapping/log/sensorlog.h>
 #include <gmapping/sensor/sensor_range/rangesensor.h>
 #include <gmapping/sensor/sensor_range/rangereading.h>
+#include <gmapping/sensor/sensor_range/rangebuffer.h>
 #include <gmapping/scanmatcher/scanmatcher.h>
 #include "motionmodel.h"
 
@@ -38,6 +41,8 @@ namespace GMapping {
     /**This class defines the the node of reversed tree in which the trajectories are stored.
        Each node of a tree has a pointer to its parent and a counter indicating the number of childs of a node.
        The tree is updated in a way consistent with the operation performed on the particles.
+       The nodes are allocated from a SlabAllocator shared by all the trees, which keeps them packed in large
+       slabs and recycles the nodes of the branches that die, instead of going through the heap for each scan.
    */
     struct TNode{
       /**Constructs a node of the trajectory tree.
@@ -50,9 +55,16 @@ namespace GMapping {
       TNode(const OrientedPoint& pose, double weight, TNode* parent=0, unsigned int childs=0);
 
       /**Destroys a tree node, and consistently updates the tree. If a node whose parent has only one child is deleted,
-       also the parent node is deleted. This because the parent will not be reacheable anymore in the trajectory tree.*/
+       also the parent node is deleted. This because the parent will not be reacheable anymore in the trajectory tree.
+       The dead branch is freed in a loop, however long it is.*/
       ~TNode();
 
+      static void* operator new(size_t size);
+      static void operator delete(void* node, size_t size);
+
+      /**@returns the statistics of the allocator of the nodes*/
+      static SlabAllocator::Statistics poolStatistics();
+
       /**The pose of the robot*/
       OrientedPoint pose; 
       
@@ -68,9 +80,8 @@ namespace GMapping {
       /**The parent*/
       TNode* parent;
 
-      /**The range reading to which this node is associated*/
-      //const RangeReading* reading; //KL Orig
-      RangeReading* reading;
+      /**The ranges of the scan to which this node is associated, shared by all the nodes of the scan*/
+      RangeBufferPtr reading;
 
       /**The number of childs*/
       unsigned int childs;
@@ -100,8 +111,16 @@ namespace GMapping {
 	  @param w the weight
       */
       inline void setWeight(double w) {weight=w;}
+      /** exchanges the content with another particle; the map, field and pyramid are not copied */
+      void swap(Particle& p);
+      /** @returns the bytes a copy of the particle duplicates: its members and the patch tables, the patches being shared */
+      size_t getCopyBytes() const;
       /** The map */
       ScanMatcherMap map;
+      /** The likelihood field of the map, maintained only if the processor uses likelihood fields */
+      LikelihoodField field;
+      /** The coarse levels of the map, maintained only if the processor matches coarse to fine or correlatively */
+      MapPyramid pyramid;
       /** The pose of the robot */
       OrientedPoint pose;
 
@@ -148,12 +167,30 @@ namespace GMapping {
     void setMatchingParameters(double urange, double range, double sigma, int kernsize, double lopt, double aopt, 
 			       int iterations, double likelihoodSigma=1, double likelihoodGain=1, unsigned int likelihoodSkip=0);
     void setMotionModelParameters(double srr, double srt, double str, double stt);
+    /**seeds the random generators drawing the odometry noise of the particles*/
+    void setMotionModelSeed(unsigned long seed);
     void setUpdateDistances(double linear, double angular, double resampleThreshold);
+    /**selects how the particles are drawn on resampling, and seeds the random generator of the draws*/
+    void setResamplingParameters(ResamplingScheme scheme, unsigned long seed);
+    /**selects how the trajectory tree stores the ranges of the processed scans, see RangeBuffer*/
+    void setReadingEncoding(RangeBuffer::Encoding encoding, double resolution=0.001);
+    inline RangeBuffer::Encoding getReadingEncoding() const {return m_readingEncoding;}
+    inline double getReadingResolution() const {return m_readingResolution;}
+
+    typedef HierarchicalArray2D<ScanMatcherCell>::Statistics MapStatistics;
+    /**@returns the memory taken by the maps of all the particles, where the shared patches are
+       the ones referenced by more than one map and are counted once. The memory taken by the
+       map of each particle is stored in particles, if given.*/
+    MapStatistics mapStatistics(std::vector<MapStatistics>* particles=0) const;
     void setUpdatePeriod(double p) {period_=p;}
     
     //the "core" algorithm
     void processTruePos(const OdometryReading& odometry);
     bool processScan(const RangeReading & reading, int adaptParticles=0);
+    /**processes a scan already encoded for the trajectory tree, with getReadingEncoding() and
+       getReadingResolution(): the tree shares the buffer, and the scan matcher works on the ranges
+       decoded into a scratch array, so the scan is copied once from its source*/
+    bool processScan(const RangeBufferPtr& ranges, const OrientedPoint& pose, double time, int adaptParticles=0);
     
     /**This method copies the state of the filter in a tree.
      The tree is represented through reversed pointers (each node has a pointer to its parent).
@@ -232,6 +269,12 @@ namespace GMapping {
     /**pose of the laser wrt the robot [scanmatcher]*/
     MEMBER_PARAM_SET_GET(m_matcher, OrientedPoint, laserPose, protected, public, public);
 
+    /**half size in translation of the window of the correlative matching [scanmatcher]*/
+    MEMBER_PARAM_SET_GET(m_matcher, double, correlativeLinearWindow, protected, public, public);
+
+    /**half size in rotation of the window of the correlative matching [scanmatcher]*/
+    MEMBER_PARAM_SET_GET(m_matcher, double, correlativeAngularWindow, protected, public, public);
+
 
     /**odometry error in translation as a function of translation (rho/rho) [motionmodel]*/
     STRUCT_PARAM_SET_GET(m_motionModel, double, srr, protected, public, public);
@@ -248,6 +291,28 @@ namespace GMapping {
     /**minimum score for considering the outcome of the scanmatching good*/
     PARAM_SET_GET(double, minimumScore, protected, public, public);
 
+    /**scan match against a likelihood field cached for each particle map, instead of searching
+       the kernel around every beam endpoint. Faster, at the price of a slightly approximated search
+       and of the memory for the fields*/
+    void setuseLikelihoodField(bool use);
+    inline bool getuseLikelihoodField() const {return m_useLikelihoodField;}
+
+    /**scan match coarse to fine, on this number of coarser levels of each particle map before the map
+       itself (0 disables it). The levels are cached for each particle, each one halves the resolution
+       of the previous one, so that the matching converges from farther away*/
+    void setmultiResolutionLevels(unsigned int levels);
+    inline unsigned int getmultiResolutionLevels() const {return m_multiResolutionLevels;}
+
+    /**scan match by searching the whole correlative window around the pose of each particle with branch
+       and bound, before hill climbing, instead of hill climbing only. It survives larger odometry errors.
+       The search uses the coarse levels of the maps, 4 of them if no multi resolution levels are set*/
+    void setuseCorrelativeMatching(bool use);
+    inline bool getuseCorrelativeMatching() const {return m_useCorrelativeMatching;}
+
+    /**the number of threads used for scan matching the particles (0 means one per cpu)*/
+    void setthreads(unsigned int threads);
+    inline unsigned int getthreads() const {return m_workerPool.size();}
+
   protected:
     /**Copy constructor*/
     GridSlamProcessor(const GridSlamProcessor& gsp);
@@ -263,12 +328,60 @@ namespace GMapping {
     /**the particle indexes after resampling (internally used)*/
     std::vector<unsigned int> m_indexes;
 
+    /**the trajectory nodes of the resampled particles (internally used)*/
+    TNodeVector m_resampledNodes;
+
     /**the particle weights (internally used)*/
     std::vector<double> m_weights;
+
+    /**the particle log weights gathered by normalize (internally used)*/
+    std::vector<double> m_logWeights;
+
+    /**draws the particle indexes on resampling*/
+    Resampler m_resampler;
     
     /**the motion model*/
     MotionModel m_motionModel;
 
+    /**the particles are moved by the motion model in blocks of this size, each block drawing from its own generator*/
+    static const unsigned int MotionBlockSize=32;
+
+    /**the random generators of the motion model, one for each block of particles*/
+    std::vector<GaussianSampler> m_motionSamplers;
+
+    /**the seed the generators of the motion model are derived from*/
+    unsigned long m_motionSeed;
+
+    /**the encoding of the ranges stored in the trajectory tree*/
+    RangeBuffer::Encoding m_readingEncoding;
+
+    /**the resolution of the quantized ranges stored in the trajectory tree*/
+    double m_readingResolution;
+
+    /**the ranges of the scan being processed, decoded from the buffer of the trajectory tree*/
+    std::vector<double> m_plainReading;
+
+    /**the threads used for processing the particles in parallel*/
+    WorkerPool m_workerPool;
+
+    /**a private copy of m_matcher for each additional worker of the pool*/
+    std::vector<ScanMatcher> m_workerMatchers;
+
+    /**whether the particles maintain and use a likelihood field*/
+    bool m_useLikelihoodField;
+
+    /**the number of coarse levels the particles maintain and match on*/
+    unsigned int m_multiResolutionLevels;
+
+    /**whether the particles are matched with the correlative branch and bound search*/
+    bool m_useCorrelativeMatching;
+
+    /**@returns the number of coarse levels of the maps the particles maintain*/
+    inline unsigned int pyramidLevels() const {return m_multiResolutionLevels?m_multiResolutionLevels:(m_useCorrelativeMatching?4:0);}
+
+    /**rebuilds the coarse levels of the particle maps after the settings changed*/
+    void resetPyramids();
+
     /**this sets the neff based resampling threshold*/
     PARAM_SET_GET(double, resampleThreshold, protected, public, public);
       
@@ -279,6 +392,10 @@ namespace GMapping {
     OrientedPoint m_pose;
     double m_linearDistance, m_angularDistance;
     PARAM_GET(double, neff, protected, public);
+    /**the entropy of the particle weights at the last normalization*/
+    PARAM_GET(double, poseEntropy, protected, public);
+    /**the bytes duplicated by copying particles at the last resampling, 0 if it did not resample*/
+    PARAM_GET(unsigned long, resampleCopyBytes, protected, public);
       
     //processing parameters (size of the map)
     PARAM_GET(double, xmin, protected, public);
@@ -314,15 +431,37 @@ namespace GMapping {
     // the functions below performs side effect on the internal structure,
     //should be called only inside the processScan method
   private:
+
+    /**scan matches a single particle, executed by the worker pool*/
+    struct ScanMatchTask: public WorkerPool::Task{
+      ScanMatchTask(GridSlamProcessor& gsp, const double* plainReading);
+      virtual void run(unsigned int index, unsigned int worker);
+      GridSlamProcessor& gsp;
+      const double* plainReading;
+      std::vector<double> scores;
+      std::vector<double> likelihoods;
+    };
     
+    /**moves a block of particles by the motion model, executed by the worker pool*/
+    struct MotionTask: public WorkerPool::Task{
+      MotionTask(GridSlamProcessor& gsp, const OrientedPoint& pnew, const OrientedPoint& pold);
+      virtual void run(unsigned int index, unsigned int worker);
+      GridSlamProcessor& gsp;
+      OrientedPoint pnew, pold;
+    };
+
+    /**processes a scan given by its ranges, by the buffer of the trajectory tree, or both:
+       the other one is made only if the scan is processed*/
+    bool processRanges(RangeBufferPtr ranges, const double* plainReading, const OrientedPoint& pose, double time, int adaptParticles);
+    /**moves all the particles by the odometry step from pold to pnew*/
+    inline void drawFromMotion(const OrientedPoint& pnew, const OrientedPoint& pold);
     /**scanmatches all the particles*/
     inline void scanMatch(const double *plainReading);
     /**normalizes the particle weights*/
     inline void normalize();
     
     // return if a resampling occured or not
-    //inline bool resample(const double* plainReading, int adaptParticles, const RangeReading* rr=0); //KL Orig
-    inline bool resample(const double* plainReading, int adaptParticles, RangeReading* rr=0);
+    inline bool resample(const double* plainReading, int adaptParticles, const RangeBufferPtr& ranges=RangeBufferPtr());
 
     
     //tree utilities
@@ -4,87 +4,113 @@
 #define isnan(x) (x==FP_NAN)
 #endif
 
+inline GridSlamProcessor::MotionTask::MotionTask(GridSlamProcessor& _gsp, const OrientedPoint& _pnew, const OrientedPoint& _pold):
+  gsp(_gsp), pnew(_pnew), pold(_pold){
+}
+
+inline void GridSlamProcessor::MotionTask::run(unsigned int index, unsigned int){
+  unsigned int begin=index*MotionBlockSize;
+  unsigned int end=std::min<unsigned int>(begin+MotionBlockSize, gsp.m_particles.size());
+  gsp.m_motionModel.drawFromMotion(&gsp.m_particles[begin], end-begin, &Particle::pose, pnew, pold, gsp.m_motionSamplers[index]);
+}
+
+/**Moves the particles by the motion model.
+Each block of particles draws its noise from its own generator, so that the blocks can be moved
+concurrently by the worker pool and the noise does not depend on the number of workers.*/
+inline void GridSlamProcessor::drawFromMotion(const OrientedPoint& pnew, const OrientedPoint& pold){
+  unsigned int blocks=(m_particles.size()+MotionBlockSize-1)/MotionBlockSize;
+  while (m_motionSamplers.size()<blocks){
+    unsigned long block=m_motionSamplers.size();
+    m_motionSamplers.push_back(GaussianSampler(m_motionSeed^(block*0x9e3779b9UL)));
+  }
+  MotionTask task(*this, pnew, pold);
+  m_workerPool.run(task, blocks);
+}
+
+inline GridSlamProcessor::ScanMatchTask::ScanMatchTask(GridSlamProcessor& _gsp, const double* _plainReading):
+  gsp(_gsp), plainReading(_plainReading), scores(_gsp.m_particles.size()), likelihoods(_gsp.m_particles.size()){
+}
+
+inline void GridSlamProcessor::ScanMatchTask::run(unsigned int index, unsigned int worker){
+  ScanMatcher& matcher=worker?gsp.m_workerMatchers[worker-1]:gsp.m_matcher;
+  Particle& particle=gsp.m_particles[index];
+  OrientedPoint corrected;
+  double s, l;
+  const LikelihoodField* field=gsp.m_useLikelihoodField?&particle.field:0;
+  if (gsp.m_useCorrelativeMatching){
+    scores[index]=matcher.correlativeOptimize(corrected, particle.map, particle.pose, plainReading, particle.pyramid, field);
+  } else {
+    const MapPyramid* pyramid=gsp.m_multiResolutionLevels?&particle.pyramid:0;
+    scores[index]=matcher.optimize(corrected, particle.map, particle.pose, plainReading, field, pyramid);
+  }
+  if (scores[index]>gsp.m_minimumScore)
+    particle.pose=corrected;
+  matcher.likelihoodAndScore(s, l, particle.map, particle.pose, plainReading, field);
+  likelihoods[index]=l;
+  particle.weight+=l;
+  particle.weightSum+=l;
+}
+
 /**Just scan match every single particle.
-If the scan matching fails, the particle gets a default likelihood.*/
+If the scan matching fails, the particle gets a default likelihood.
+The particles are matched concurrently by the worker pool, each worker uses its own copy of the matcher.
+The maps are only read here: the patches a scan changes are detached when it is registered.*/
 inline void GridSlamProcessor::scanMatch(const double* plainReading){
+  // the maps may have been resized or scrolled since the last registration, the fields and pyramids are indexed like the maps
+  for (ParticleVector::iterator it=m_particles.begin(); it!=m_particles.end(); it++){
+    if (m_useLikelihoodField)
+      it->field.follow(it->map);
+    if (pyramidLevels())
+      it->pyramid.follow(it->map);
+  }
+
   // sample a new pose from each scan in the reference
   
+  m_workerMatchers.resize(m_workerPool.size()-1);
+  for (unsigned int i=0; i<m_workerMatchers.size(); i++)
+    m_workerMatchers[i]=m_matcher;
+  
+  ScanMatchTask task(*this, plainReading);
+  m_workerPool.run(task, m_particles.size());
+
   double sumScore=0;
-  for (ParticleVector::iterator it=m_particles.begin(); it!=m_particles.end(); it++){
-    OrientedPoint corrected;
-    double score, l, s;
-    score=m_matcher.optimize(corrected, it->map, it->pose, plainReading);
-    //    it->pose=corrected;
-    if (score>m_minimumScore){
-      it->pose=corrected;
-    } else {
-	if (m_infoStream){
-	  m_infoStream << "Scan Matching Failed, using odometry. Likelihood=" << l <<std::endl;
-	  m_infoStream << "lp:" << m_lastPartPose.x << " "  << m_lastPartPose.y << " "<< m_lastPartPose.theta <<std::endl;
-	  m_infoStream << "op:" << m_odoPose.x << " " << m_odoPose.y << " "<< m_odoPose.theta <<std::endl;
-	}
+  for (unsigned int i=0; i<m_particles.size(); i++){
+    if (task.scores[i]<=m_minimumScore && m_infoStream){
+      m_infoStream << "Scan Matching Failed, using odometry. Likelihood=" << task.likelihoods[i] <<std::endl;
+      m_infoStream << "lp:" << m_lastPartPose.x << " "  << m_lastPartPose.y << " "<< m_lastPartPose.theta <<std::endl;
+      m_infoStream << "op:" << m_odoPose.x << " " << m_odoPose.y << " "<< m_odoPose.theta <<std::endl;
     }
-
-    m_matcher.likelihoodAndScore(s, l, it->map, it->pose, plainReading);
-    sumScore+=score;
-    it->weight+=l;
-    it->weightSum+=l;
-
-    //set up the selective copy of the active area
-    //by detaching the areas that will be updated
-    m_matcher.invalidateActiveArea();
-    m_matcher.computeActiveArea(it->map, it->pose, plainReading);
+    sumScore+=task.scores[i];
   }
   if (m_infoStream)
     m_infoStream << "Average Scan Matching Score=" << sumScore/m_particles.size() << std::endl;	
 }
 
 inline void GridSlamProcessor::normalize(){
-  //normalize the log m_weights
-  double gain=1./(m_obsSigmaGain*m_particles.size());
-  double lmax= -std::numeric_limits<double>::max();
-  for (ParticleVector::iterator it=m_particles.begin(); it!=m_particles.end(); it++){
-    lmax=it->weight>lmax?it->weight:lmax;
-  }
-  //cout << "!!!!!!!!!!! maxwaight= "<< lmax << endl;
-  
-  m_weights.clear();
-  double wcum=0;
-  m_neff=0;
-  for (std::vector<Particle>::iterator it=m_particles.begin(); it!=m_particles.end(); it++){
-    m_weights.push_back(exp(gain*(it->weight-lmax)));
-    wcum+=m_weights.back();
-    //cout << "l=" << it->weight<< endl;
-  }
-  
-  m_neff=0;
-  for (std::vector<double>::iterator it=m_weights.begin(); it!=m_weights.end(); it++){
-    *it=*it/wcum;
-    double w=*it;
-    m_neff+=w*w;
-  }
-  m_neff=1./m_neff;
-  
+  //gather the log weights next to each other, the buffers keep their capacity from scan to scan
+  unsigned int size=m_particles.size();
+  m_logWeights.resize(size);
+  m_weights.resize(size);
+  for (unsigned int i=0; i<size; i++)
+    m_logWeights[i]=m_particles[i].weight;
+  if (!size)
+    return;
+  WeightStatistics stats=normalizeLogWeights(&m_weights[0], &m_logWeights[0], size, 1./(m_obsSigmaGain*size));
+  m_neff=stats.neff;
+  m_poseEntropy=stats.entropy;
 }
 
-//inline bool GridSlamProcessor::resample(const double* plainReading, int adaptSize, const RangeReading* reading){ //KL Orig
-inline bool GridSlamProcessor::resample(const double* plainReading, int adaptSize, RangeReading* reading){
+inline bool GridSlamProcessor::resample(const double* plainReading, int adaptSize, const RangeBufferPtr& ranges){
 
   
   bool hasResampled = false;
   
-  TNodeVector oldGeneration;
-  for (unsigned int i=0; i<m_particles.size(); i++){
-    oldGeneration.push_back(m_particles[i].node);
-  }
-  
   if (m_neff<m_resampleThreshold*m_particles.size()){		
     
     if (m_infoStream)
       m_infoStream  << "*************RESAMPLE***************" << std::endl;
     
-    uniform_resampler<double, double> resampler;
-    m_indexes=resampler.resampleIndexes(m_weights, adaptSize);
+    m_resampler.resampleIndexes(m_indexes, m_weights, adaptSize);
     
     if (m_outputStream.is_open()){
       m_outputStream << "RESAMPLE "<< m_indexes.size() << " ";
@@ -96,78 +122,102 @@ inline bool GridSlamProcessor::resample(const double* plainReading, int adaptSiz
     
     onResampleUpdate();
     //BEGIN: BUILDING TREE
-    ParticleVector temp;
-    unsigned int j=0;
-    std::vector<unsigned int> deletedParticles;  		//this is for deleteing the particles which have been resampled away.
-    
-    //		cerr << "Existing Nodes:" ;
-    for (unsigned int i=0; i<m_indexes.size(); i++){
-      //			cerr << " " << m_indexes[i];
-      while(j<m_indexes[i]){
-	deletedParticles.push_back(j);
-	j++;
-			}
-      if (j==m_indexes[i])
-	j++;
+    //the new nodes are created while the particles still point to their parents
+    unsigned int size=m_indexes.size();
+    m_resampledNodes.resize(size);
+    for (unsigned int i=0; i<size; i++){
       Particle & p=m_particles[m_indexes[i]];
-      TNode* node=0;
-      TNode* oldNode=oldGeneration[m_indexes[i]];
-      //			cerr << i << "->" << m_indexes[i] << "B("<<oldNode->childs <<") ";
-      node=new	TNode(p.pose, 0, oldNode, 0);
-      //node->reading=0;
-      node->reading=reading;
-      //			cerr << "A("<<node->parent->childs <<") " <<endl;
-      
-      temp.push_back(p);
-      temp.back().node=node;
-      temp.back().previousIndex=m_indexes[i];
-    }
-    while(j<m_indexes.size()){
-      deletedParticles.push_back(j);
-      j++;
+      TNode* node=new TNode(p.pose, 0, p.node, 0);
+      node->reading=ranges;
+      m_resampledNodes[i]=node;
     }
-    //		cerr << endl;
+    //the particles resampled away are the ones missing from the sorted indexes; their nodes
+    //are deleted only now that the new nodes hold their shared ancestors
     std::cerr <<  "Deleting Nodes:";
-    for (unsigned int i=0; i<deletedParticles.size(); i++){
-      std::cerr <<" " << deletedParticles[i];
-      delete m_particles[deletedParticles[i]].node;
-      m_particles[deletedParticles[i]].node=0;
+    unsigned int k=0;
+    for (unsigned int j=0; j<m_particles.size(); j++){
+      while (k<size && m_indexes[k]<j)
+        k++;
+      if (k<size && m_indexes[k]==j)
+        continue;
+      std::cerr <<" " << j;
+      delete m_particles[j].node;
+      m_particles[j].node=0;
     }
     std::cerr  << " Done" <<std::endl;
-    
     //END: BUILDING TREE
-    std::cerr << "Deleting old particles..." ;
-    m_particles.clear();
-    std::cerr << "Done" << std::endl;
-    std::cerr << "Copying Particles and  Registering  scans...";
-    for (ParticleVector::iterator it=temp.begin(); it!=temp.end(); it++){
-      it->setWeight(0);
-      m_matcher.invalidateActiveArea();
-      m_matcher.registerScan(it->map, it->pose, plainReading);
-      m_particles.push_back(*it);
+
+    //the first copy of each survivor takes its place by swapping, the others share its map.
+    //As the indexes are sorted, the survivors keep their order: the ones moving to a lower
+    //slot find it free when moved in increasing order, the others when moved in decreasing order
+    std::cerr << "Moving Particles...";
+    m_resampleCopyBytes=0;
+    //when the set grows, the new slots get particles with an empty map, which are swapped or
+    //overwritten below; the vector grows by swapping the particles over, so no map is copied
+    if (m_particles.size()<size){
+      Particle empty(ScanMatcherMap(0, 0, m_delta));
+      if (m_particles.capacity()<size){
+        ParticleVector grown;
+        grown.reserve(size);
+        grown.resize(m_particles.size(), empty);
+        for (unsigned int i=0; i<m_particles.size(); i++)
+          grown[i].swap(m_particles[i]);
+        m_particles.swap(grown);
+      }
+      m_particles.resize(size, empty);
+    }
+    for (unsigned int i=0; i<size; i++)
+      if ((!i || m_indexes[i-1]!=m_indexes[i]) && m_indexes[i]>i)
+        m_particles[i].swap(m_particles[m_indexes[i]]);
+    for (unsigned int i=size; i-- >0; )
+      if ((!i || m_indexes[i-1]!=m_indexes[i]) && m_indexes[i]<i)
+        m_particles[i].swap(m_particles[m_indexes[i]]);
+    for (unsigned int i=1, first=0; i<size; i++){
+      if (m_indexes[i]!=m_indexes[first]){
+        first=i;
+        continue;
+      }
+      m_resampleCopyBytes+=m_particles[first].getCopyBytes();
+      m_particles[i]=m_particles[first];
+    }
+    m_particles.erase(m_particles.begin()+size, m_particles.end());
+    std::cerr << "Done, " << m_resampleCopyBytes << " bytes copied" << std::endl;
+
+    std::cerr << "Registering scans...";
+    for (unsigned int i=0; i<size; i++){
+      Particle& p=m_particles[i];
+      p.node=m_resampledNodes[i];
+      p.previousIndex=m_indexes[i];
+      p.setWeight(0);
+      m_matcher.registerScanSinglePass(p.map, p.pose, plainReading);
+      if (m_useLikelihoodField)
+        m_matcher.updateLikelihoodField(p.field, p.map);
+      if (pyramidLevels())
+        m_matcher.updateMapPyramid(p.pyramid, p.map, pyramidLevels());
     }
     std::cerr  << " Done" <<std::endl;
     hasResampled = true;
   } else {
     int index=0;
+    m_resampleCopyBytes=0;
     std::cerr << "Registering Scans:";
-    TNodeVector::iterator node_it=oldGeneration.begin();
     for (ParticleVector::iterator it=m_particles.begin(); it!=m_particles.end(); it++){
       //create a new node in the particle tree and add it to the old tree
       //BEGIN: BUILDING TREE  
       TNode* node=0;
-      node=new TNode(it->pose, 0.0, *node_it, 0);
+      node=new TNode(it->pose, 0.0, it->node, 0);
       
-      //node->reading=0;
-      node->reading=reading;
+      node->reading=ranges;
       it->node=node;
 
       //END: BUILDING TREE
-      m_matcher.invalidateActiveArea();
-      m_matcher.registerScan(it->map, it->pose, plainReading);
+      m_matcher.registerScanSinglePass(it->map, it->pose, plainReading);
+      if (m_useLikelihoodField)
+        m_matcher.updateLikelihoodField(it->field, it->map);
+      if (pyramidLevels())
+        m_matcher.updateMapPyramid(it->pyramid, it->map, pyramidLevels());
       it->previousIndex=index;
       index++;
-      node_it++;
       
     }
     std::cerr  << "Done" <<std::endl;
@@ -10,10 +10,31 @@ namespace  GMapping {
 struct MotionModel{
 	OrientedPoint drawFromMotion(const OrientedPoint& p, double linearMove, double angularMove) const;
 	OrientedPoint drawFromMotion(const OrientedPoint& p, const OrientedPoint& pnew, const OrientedPoint& pold) const;
+	/**moves the pose member of n objects by the odometry step from pold to pnew, as the single pose version does.
+	The step and the noise sigmas are computed once, and the noise of the whole batch is drawn at once from the sampler.*/
+	template <class T>
+	void drawFromMotion(T* objects, unsigned int n, OrientedPoint T::*pose, const OrientedPoint& pnew, const OrientedPoint& pold, GaussianSampler& sampler) const;
 	Covariance3 gaussianApproximation(const OrientedPoint& pnew, const OrientedPoint& pold) const;
 	double srr, str, srt, stt;
 };
 
+template <class T>
+void MotionModel::drawFromMotion(T* objects, unsigned int n, OrientedPoint T::*pose, const OrientedPoint& pnew, const OrientedPoint& pold, GaussianSampler& sampler) const{
+	double sxy=0.3*srr;
+	OrientedPoint delta=absoluteDifference(pnew, pold);
+	double sx=srr*fabs(delta.x)+str*fabs(delta.theta)+sxy*fabs(delta.y);
+	double sy=srr*fabs(delta.y)+str*fabs(delta.theta)+sxy*fabs(delta.x);
+	double st=stt*fabs(delta.theta)+srt*sqrt(delta.x*delta.x+delta.y*delta.y);
+	const double* noise=sampler.samples(3*n);
+	for (unsigned int i=0; i<n; i++){
+		OrientedPoint noisypoint(delta.x+sx*noise[3*i], delta.y+sy*noise[3*i+1], delta.theta+st*noise[3*i+2]);
+		noisypoint.theta=fmod(noisypoint.theta, 2*M_PI);
+		if (noisypoint.theta>M_PI)
+			noisypoint.theta-=2*M_PI;
+		objects[i].*pose=absoluteSum(objects[i].*pose, noisypoint);
+	}
+}
+
 };
 
 #endif
@@ -118,6 +118,44 @@ void normalize(const Iterator& begin, const Iterator& end){
 	}
 }
 
+/**the effective sample size and the entropy of a set of normalized weights*/
+struct WeightStatistics{
+	double neff;
+	double entropy;
+};
+
+/**normalizes n log weights scaled by gain, weights[i]=exp(gain*(logWeights[i]-lmax))/sum.
+With x[i]=gain*(logWeights[i]-lmax) and e[i]=exp(x[i]), the effective sample size is
+sum(e)^2/sum(e^2) and the entropy -sum(w log w) is log(sum(e))-sum(e x)/sum(e), so that
+all of them come from the sums accumulated by the loop computing the exponentials, and
+the weights are only touched once more to be scaled.
+The weights are plain arrays, which keeps the loops over contiguous memory, and nothing is allocated.*/
+inline WeightStatistics normalizeLogWeights(double* weights, const double* logWeights, unsigned int n, double gain){
+	WeightStatistics stats;
+	stats.neff=0;
+	stats.entropy=0;
+	if (!n)
+		return stats;
+	double lmax=logWeights[0];
+	for (unsigned int i=1; i<n; i++)
+		lmax=logWeights[i]>lmax?logWeights[i]:lmax;
+	double sum=0, xsum=0, squares=0;
+	for (unsigned int i=0; i<n; i++){
+		double x=gain*(logWeights[i]-lmax);
+		double e=exp(x);
+		weights[i]=e;
+		sum+=e;
+		xsum+=e*x;
+		squares+=e*e;
+	}
+	double inverse=1./sum;
+	for (unsigned int i=0; i<n; i++)
+		weights[i]*=inverse;
+	stats.neff=sum*sum/squares;
+	stats.entropy=log(sum)-xsum*inverse;
+	return stats;
+}
+
 template <class OutputIterator, class Iterator>
 void rle(OutputIterator& out, const Iterator & begin, const Iterator & end){
 	unsigned int current=0;
@@ -142,6 +180,107 @@ void rle(OutputIterator& out, const Iterator & begin, const Iterator & end){
 		out++;
 }
 
+/**the ways a Resampler draws the particles*/
+enum ResamplingScheme{
+	/**evenly spaced draws after a single random offset, as uniform_resampler does*/
+	SystematicResampling,
+	/**an independent random draw in each of the n equal strata of the cumulative weight*/
+	StratifiedResampling,
+	/**floor(n w) copies of each particle, the remaining ones drawn systematically from what is left of the weights*/
+	ResidualResampling
+};
+
+/**Draws the indexes of the particles surviving a resampling.
+The indexes are written in increasing order into a buffer of the caller, which keeps its capacity
+from one resampling to the next. The random numbers come from a generator owned by the resampler,
+so that the same seed draws the same particles whatever else uses drand48.*/
+class Resampler{
+	public:
+		inline Resampler(ResamplingScheme scheme=SystematicResampling, unsigned long seed=0);
+		inline void setScheme(ResamplingScheme scheme) {m_scheme=scheme;}
+		inline ResamplingScheme getScheme() const {return m_scheme;}
+		/**restarts the random generator, which then gives the numbers drand48() gives after srand48(seed)*/
+		inline void seed(unsigned long seed);
+		/**@returns a random number uniformly distributed in [0,1)*/
+		inline double uniform() {return erand48(m_state);}
+		/**draws n indexes (as many as the weights if n is 0) proportionally to the weights, which need not be normalized*/
+		inline void resampleIndexes(std::vector<unsigned int>& indexes, const std::vector<double>& weights, unsigned int n=0);
+	protected:
+		/**writes n increasing indexes of the m weights summing to total into indexes, either systematically or stratified*/
+		inline void draw(unsigned int* indexes, const double* weights, unsigned int m, unsigned int n, double total, bool stratified);
+		ResamplingScheme m_scheme;
+		unsigned short m_state[3];
+		std::vector<double> m_residuals;
+};
+
+Resampler::Resampler(ResamplingScheme scheme, unsigned long seed){
+	m_scheme=scheme;
+	this->seed(seed);
+}
+
+void Resampler::seed(unsigned long seed){
+	m_state[0]=0x330e;
+	m_state[1]=seed&0xffff;
+	m_state[2]=(seed>>16)&0xffff;
+}
+
+void Resampler::draw(unsigned int* indexes, const double* weights, unsigned int m, unsigned int n, double total, bool stratified){
+	if (!n)
+		return;
+	double interval=total/n;
+	double target=interval*uniform();
+	double cweight=0;
+	unsigned int k=0, last=0;
+	for (unsigned int i=0; i<m && k<n; i++){
+		cweight+=weights[i];
+		if (weights[i]>0)
+			last=i;
+		while (k<n && cweight>target){
+			indexes[k++]=i;
+			target=stratified?interval*(k+uniform()):target+interval;
+		}
+	}
+	//the rounding of the cumulative weight may leave the last targets beyond it
+	while (k<n)
+		indexes[k++]=last;
+}
+
+void Resampler::resampleIndexes(std::vector<unsigned int>& indexes, const std::vector<double>& weights, unsigned int n){
+	unsigned int m=weights.size();
+	if (!n)
+		n=m;
+	indexes.resize(m?n:0);
+	if (!m || !n)
+		return;
+	double total=0;
+	for (unsigned int i=0; i<m; i++)
+		total+=weights[i];
+	if (m_scheme!=ResidualResampling){
+		draw(&indexes[0], &weights[0], m, n, total, m_scheme==StratifiedResampling);
+		return;
+	}
+
+	//the residual draws go at the beginning of the buffer, then are merged from the back with the copies
+	m_residuals.resize(m);
+	unsigned int copies=0;
+	double residual=0;
+	for (unsigned int i=0; i<m; i++){
+		double expected=n*weights[i]/total;
+		double c=floor(expected);
+		m_residuals[i]=expected-c;
+		residual+=m_residuals[i];
+		copies+=(unsigned int)c;
+	}
+	draw(&indexes[0], &m_residuals[0], m, n-copies, residual, false);
+	unsigned int w=n, r=n-copies;
+	for (unsigned int i=m; i-- >0 && w>0; ){
+		while (r>0 && indexes[r-1]==i)
+			indexes[--w]=indexes[--r];
+		for (unsigned int c=(unsigned int)floor(n*weights[i]/total); c>0; c--)
+			indexes[--w]=i;
+	}
+}
+
 //BEGIN legacy
 template <class Particle, class Numeric>
 struct uniform_resampler{
@@ -0,0 +1,67 @@
+#ifndef BEAMPROJECTION_H
+#define BEAMPROJECTION_H
+
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace GMapping {
+
+/**Rotates the unit vectors (ux[i], uy[i]) of n beams by theta.
+With ux[i]=cos(a[i]) and uy[i]=sin(a[i]) this gives dx[i]=cos(theta+a[i]) and dy[i]=sin(theta+a[i])
+at the cost of a single cos/sin pair for the whole scan.*/
+inline void rotateBeams(double* dx, double* dy, const double* ux, const double* uy, unsigned int n, double theta){
+	double c=cos(theta), s=sin(theta);
+	unsigned int i=0;
+#if defined(__AVX__)
+	__m256d vc=_mm256_set1_pd(c), vs=_mm256_set1_pd(s);
+	for (; i+4<=n; i+=4){
+		__m256d x=_mm256_loadu_pd(ux+i), y=_mm256_loadu_pd(uy+i);
+		_mm256_storeu_pd(dx+i, _mm256_sub_pd(_mm256_mul_pd(vc, x), _mm256_mul_pd(vs, y)));
+		_mm256_storeu_pd(dy+i, _mm256_add_pd(_mm256_mul_pd(vs, x), _mm256_mul_pd(vc, y)));
+	}
+#elif defined(__SSE2__)
+	__m128d vc=_mm_set1_pd(c), vs=_mm_set1_pd(s);
+	for (; i+2<=n; i+=2){
+		__m128d x=_mm_loadu_pd(ux+i), y=_mm_loadu_pd(uy+i);
+		_mm_storeu_pd(dx+i, _mm_sub_pd(_mm_mul_pd(vc, x), _mm_mul_pd(vs, y)));
+		_mm_storeu_pd(dy+i, _mm_add_pd(_mm_mul_pd(vs, x), _mm_mul_pd(vc, y)));
+	}
+#endif
+	for (; i<n; i++){
+		dx[i]=c*ux[i]-s*uy[i];
+		dy[i]=s*ux[i]+c*uy[i];
+	}
+}
+
+/**Computes the endpoints (x[i], y[i]) of n beams of length r[i] leaving (px, py) along the directions (dx[i], dy[i]).*/
+inline void projectBeams(double* x, double* y, const double* dx, const double* dy, const double* r, unsigned int n, double px, double py){
+	unsigned int i=0;
+#if defined(__AVX__)
+	__m256d vx=_mm256_set1_pd(px), vy=_mm256_set1_pd(py);
+	for (; i+4<=n; i+=4){
+		__m256d vr=_mm256_loadu_pd(r+i);
+		_mm256_storeu_pd(x+i, _mm256_add_pd(vx, _mm256_mul_pd(vr, _mm256_loadu_pd(dx+i))));
+		_mm256_storeu_pd(y+i, _mm256_add_pd(vy, _mm256_mul_pd(vr, _mm256_loadu_pd(dy+i))));
+	}
+#elif defined(__SSE2__)
+	__m128d vx=_mm_set1_pd(px), vy=_mm_set1_pd(py);
+	for (; i+2<=n; i+=2){
+		__m128d vr=_mm_loadu_pd(r+i);
+		_mm_storeu_pd(x+i, _mm_add_pd(vx, _mm_mul_pd(vr, _mm_loadu_pd(dx+i))));
+		_mm_storeu_pd(y+i, _mm_add_pd(vy, _mm_mul_pd(vr, _mm_loadu_pd(dy+i))));
+	}
+#endif
+	for (; i<n; i++){
+		x[i]=px+r[i]*dx[i];
+		y[i]=py+r[i]*dy[i];
+	}
+}
+
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef LIKELIHOODFIELD_H
+#define LIKELIHOODFIELD_H
+
+#include <gmapping/grid/harray2d.h>
+#include <gmapping/utils/point.h>
+#include "smmap.h"
+
+namespace GMapping {
+
+/**A cell of the likelihood field. It caches the result of the kernel search around a cell of
+the map: the mean of the closest occupied cell within the kernel and its offset from this cell.*/
+struct FieldCell{
+	typedef point<float> FloatPoint;
+	FieldCell(): mean(0,0), dx(0), dy(0), valid(false){}
+	inline IntPoint offset() const {return IntPoint(dx,dy);}
+	FloatPoint mean;
+	signed char dx, dy;
+	bool valid;
+};
+
+/**A likelihood field built over a ScanMatcherMap. It has the same geometry and the same patch
+structure as the map it follows, and its patches are shared between copies in the same way,
+so each particle can keep its own field at the cost of the patches that actually change.
+The field is updated incrementally, only around the active area of the last registered scan.
+For each cell it stores the occupied cell within the kernel whose mean is the closest to the
+center of the cell. This approximates the kernel search of the ScanMatcher, which picks the
+mean closest to the beam endpoint among the candidates whose free cell is actually free.*/
+class LikelihoodField{
+	public:
+		LikelihoodField();
+
+		/**brings the field up to date with the map after a scan has been registered.
+		The cells around the active area of the map are recomputed; the whole field is built
+		the first time or when the parameters of the search change.*/
+		void update(const ScanMatcherMap& map, int kernelSize, double fullnessThreshold);
+
+		/**realigns the field with the map after the map has been resized or scrolled, so that
+		cell() is indexed like the map again. The patches entering the map are left unknown.*/
+		void follow(const ScanMatcherMap& map);
+
+		/**drops the content of the field*/
+		void clear();
+
+		/**exchanges the content with another field, without copying it*/
+		void swap(LikelihoodField& field);
+
+		/**@returns the bytes a copy of the field duplicates, the patches being shared*/
+		inline size_t getTableBytes() const {return m_storage.getTableBytes();}
+
+		/**@returns the field cell for the map cell p, 0 if nothing is known about it*/
+		inline const FieldCell* cell(const IntPoint& p) const;
+
+		inline bool isValid() const {return m_valid;}
+	protected:
+		void build(const ScanMatcherMap& map, const HierarchicalArray2D<FieldCell>::PointList& patches);
+
+		HierarchicalArray2D<FieldCell> m_storage;
+		Point m_origin;
+		double m_delta;
+		bool m_valid;
+		int m_kernelSize;
+		double m_fullnessThreshold;
+};
+
+inline const FieldCell* LikelihoodField::cell(const IntPoint& p) const{
+	if (!(m_storage.cellState(p)&Allocated))
+		return 0;
+	const FieldCell& c=m_storage.cell(p);
+	return c.valid?&c:0;
+}
+
+};
+
+#endif
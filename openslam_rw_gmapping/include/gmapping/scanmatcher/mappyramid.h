@@ -0,0 +1,72 @@
+#ifndef MAPPYRAMID_H
+#define MAPPYRAMID_H
+
+#include <vector>
+#include <gmapping/grid/harray2d.h>
+#include <gmapping/utils/point.h>
+#include "smmap.h"
+
+namespace GMapping {
+
+/**A stack of coarser versions of a ScanMatcherMap, used to scan match coarse to fine.
+The cells of level l are 2^l times larger than the ones of the map, and hold the highest
+occupancy among the map cells they cover, the cells under the fullness threshold counting
+as empty. A scan thus scores on a coarse level at least as well as any pose whose endpoints
+fall in the same coarse cells would do on the map.
+Like the LikelihoodField, each level has the patch structure of the map, so that a patch of
+the map is summarized by exactly one patch of each level, the patches are shared between
+copies, and only the patches under the active area of the last registered scan are updated.
+The levels are at most as many as the patch magnitude of the map.*/
+class MapPyramid{
+	public:
+		MapPyramid();
+
+		/**brings the levels up to date with the map after a scan has been registered.
+		The patches under the active area of the map are recomputed; all of them are built
+		the first time or when the parameters change.*/
+		void update(const ScanMatcherMap& map, unsigned int levels, double fullnessThreshold);
+
+		/**realigns the levels with the map after the map has been resized or scrolled, so that
+		value() is indexed like the map again. The patches entering the map are left unobserved.*/
+		void follow(const ScanMatcherMap& map);
+
+		/**drops the content of the pyramid*/
+		void clear();
+
+		/**exchanges the content with another pyramid, without copying it*/
+		void swap(MapPyramid& pyramid);
+
+		/**@returns the bytes a copy of the pyramid duplicates, the patches being shared*/
+		size_t getTableBytes() const;
+
+		/**@returns the number of coarse levels, 0 if the pyramid is empty*/
+		inline unsigned int getLevels() const {return m_levels.size();}
+
+		/**@returns the value of the cell of the given level (1..getLevels()) containing the map cell p,
+		0 if p is outside the map or in an area never observed*/
+		inline float value(unsigned int level, const IntPoint& p) const;
+
+	protected:
+		typedef HierarchicalArray2D<float> Level;
+		void build(const ScanMatcherMap& map, const Level::PointList& patches);
+
+		std::vector<Level> m_levels;
+		Point m_origin;
+		double m_delta;
+		double m_fullnessThreshold;
+		bool m_valid;
+};
+
+inline float MapPyramid::value(unsigned int level, const IntPoint& p) const{
+	if (p.x<0 || p.y<0)
+		return 0;
+	const Level& l=m_levels[level-1];
+	IntPoint c(p.x>>level, p.y>>level);
+	if (!(l.cellState(c)&Allocated))
+		return 0;
+	return l.cell(c);
+}
+
+};
+
+#endif
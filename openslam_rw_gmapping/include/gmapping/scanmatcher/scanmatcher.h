@@ -3,6 +3,9 @@
 
 #include "icp.h"
 #include "smmap.h"
+#include "likelihoodfield.h"
+#include "mappyramid.h"
+#include "beamprojection.h"
 #include <gmapping/utils/macro_params.h>
 #include <gmapping/utils/stat.h>
 #include <iostream>
@@ -18,24 +21,49 @@ class ScanMatcher{
 		ScanMatcher();
 		~ScanMatcher();
 		double icpOptimize(OrientedPoint& pnew, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings) const;
-		double optimize(OrientedPoint& pnew, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings) const;
+		/**hill climbs from p to the pose where the scan fits the map best. If a pyramid of the map is given,
+		the climb starts from the best pose found on its levels, coarse to fine.*/
+		double optimize(OrientedPoint& pnew, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings, const LikelihoodField* field=0, const MapPyramid* pyramid=0) const;
 		double optimize(OrientedPoint& mean, CovarianceMatrix& cov, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings) const;
+		/**searches exhaustively the poses within the correlative window around p for the one whose beams hit
+		the most occupied cells, on a lattice of one map cell in translation and, in rotation, of the step moving
+		the farthest endpoint by about one cell. The search is pruned by branch and bound on the levels of the
+		pyramid, and its result is refined by the hill climbing of optimize().*/
+		double correlativeOptimize(OrientedPoint& pnew, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings, const MapPyramid& pyramid, const LikelihoodField* field=0) const;
 		
 		double   registerScan(ScanMatcherMap& map, const OrientedPoint& p, const double* readings);
+		/**registers the scan tracing each beam once. The map is enlarged as needed, and each patch is
+		detached from the other maps the first time the scan touches it, instead of copying the whole
+		active area up front. The patches touched become the active area of the map, and are added to its
+		dirty area when the storage tracks it.
+		The entropy change, which costs two logarithms per traversed cell, is returned only if computeEntropy is set.*/
+		double   registerScanSinglePass(ScanMatcherMap& map, const OrientedPoint& p, const double* readings, bool computeEntropy=false);
 		void setLaserParameters
 			(unsigned int beams, double* angles, const OrientedPoint& lpose);
 		void setMatchingParameters
 			(double urange, double range, double sigma, int kernsize, double lopt, double aopt, int iterations, double likelihoodSigma=1, unsigned int likelihoodSkip=0 );
 		void invalidateActiveArea();
 		void computeActiveArea(ScanMatcherMap& map, const OrientedPoint& p, const double* readings);
+		/**updates the likelihood field of map after a scan has been registered in it*/
+		void updateLikelihoodField(LikelihoodField& field, const ScanMatcherMap& map) const;
+		/**updates the given number of coarse levels of the map after a scan has been registered in it*/
+		void updateMapPyramid(MapPyramid& pyramid, const ScanMatcherMap& map, unsigned int levels) const;
 
 		inline double icpStep(OrientedPoint & pret, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings) const;
-		inline double score(const ScanMatcherMap& map, const OrientedPoint& p, const double* readings) const;
-		inline unsigned int likelihoodAndScore(double& s, double& l, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings) const;
+		/**score and likelihoodAndScore look for the correspondence of a beam endpoint in the kernel around it,
+		or in the likelihood field of the map if one is given*/
+		inline double score(const ScanMatcherMap& map, const OrientedPoint& p, const double* readings, const LikelihoodField* field=0) const;
+		/**as above, with the beam directions of the pose already computed by rotateBeams(), so that poses
+		differing only by a translation share them*/
+		inline double score(const ScanMatcherMap& map, const OrientedPoint& p, const double* readings, const double* dirX, const double* dirY, const LikelihoodField* field=0) const;
+		inline unsigned int likelihoodAndScore(double& s, double& l, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings, const LikelihoodField* field=0) const;
 		double likelihood(double& lmax, OrientedPoint& mean, CovarianceMatrix& cov, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings);
 		double likelihood(double& _lmax, OrientedPoint& _mean, CovarianceMatrix& _cov, const ScanMatcherMap& map, const OrientedPoint& p, Gaussian3& odometry, const double* readings, double gain=180.);
 		inline const double* laserAngles() const { return m_laserAngles; }
 		inline unsigned int laserBeams() const { return m_laserBeams; }
+		/**computes the direction of each beam in the world frame when the robot has orientation theta*/
+		inline void beamDirections(double* dirX, double* dirY, double theta) const
+			{ rotateBeams(dirX, dirY, m_laserDirX, m_laserDirY, m_laserBeams, theta+m_laserPose.theta); }
 		
 		static const double nullLikelihood;
 	protected:
@@ -45,6 +73,9 @@ class ScanMatcher{
 		/**laser parameters*/
 		unsigned int m_laserBeams;
 		double       m_laserAngles[LASER_MAXBEAMS];
+		/**unit vectors of the beams in the laser frame, the input of the beam projection*/
+		double       m_laserDirX[LASER_MAXBEAMS];
+		double       m_laserDirY[LASER_MAXBEAMS];
 		//OrientedPoint m_laserPose;
 		PARAM_SET_GET(OrientedPoint, laserPose, protected, public, public)
 		PARAM_SET_GET(double, laserMaxRange, protected, public, public)
@@ -68,35 +99,47 @@ class ScanMatcher{
 		PARAM_SET_GET(double, linearOdometryReliability, protected, public, public)
 		PARAM_SET_GET(double, freeCellRatio, protected, public, public)
 		PARAM_SET_GET(unsigned int, initialBeamsSkip, protected, public, public)
+		/**half sizes of the window searched by correlativeOptimize(), in meters and radians*/
+		PARAM_SET_GET(double, correlativeLinearWindow, protected, public, public)
+		PARAM_SET_GET(double, correlativeAngularWindow, protected, public, public)
 
-		// allocate this large array only once
-		IntPoint* m_linePoints;
+		void enlargeMap(ScanMatcherMap& map, const OrientedPoint& lp, const double* dirX, const double* dirY, const double* readings) const;
+		/**@returns the factor penalizing the poses away from the odometry, 1 if the odometry is not trusted*/
+		inline double odometryGain(const OrientedPoint& init, const OrientedPoint& p) const;
+		/**scores a pose on a coarse level of the pyramid: the sum of the values of the cells hit by the beams*/
+		inline double coarseScore(const MapPyramid& pyramid, unsigned int level, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings, const double* dirX, const double* dirY) const;
+		/**hill climbs from init on each level of the pyramid, from the coarsest, moving by one cell of the level*/
+		OrientedPoint coarseOptimize(const MapPyramid& pyramid, const ScanMatcherMap& map, const OrientedPoint& init, const double* readings) const;
+		/**the branch and bound search of correlativeOptimize()*/
+		OrientedPoint branchAndBound(const MapPyramid& pyramid, const ScanMatcherMap& map, const OrientedPoint& init, const double* readings) const;
+
+		// the patches touched by the last scan, kept to reuse its memory
+		HierarchicalArray2D<ScanMatcherCell>::PointList m_activeArea;
 };
 
 inline double ScanMatcher::icpStep(OrientedPoint & pret, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings) const{
-	const double * angle=m_laserAngles+m_initialBeamsSkip;
 	OrientedPoint lp=p;
 	lp.x+=cos(p.theta)*m_laserPose.x-sin(p.theta)*m_laserPose.y;
 	lp.y+=sin(p.theta)*m_laserPose.x+cos(p.theta)*m_laserPose.y;
 	lp.theta+=m_laserPose.theta;
+	double dirX[LASER_MAXBEAMS], dirY[LASER_MAXBEAMS];
+	double hitX[LASER_MAXBEAMS], hitY[LASER_MAXBEAMS];
+	beamDirections(dirX, dirY, p.theta);
+	projectBeams(hitX, hitY, dirX, dirY, readings, m_laserBeams, lp.x, lp.y);
 	unsigned int skip=0;
 	double freeDelta=map.getDelta()*m_freeCellRatio;
+	double freeStep=map.getDelta()*freeDelta;
 	std::list<PointPair> pairs;
 	
-	for (const double* r=readings+m_initialBeamsSkip; r<readings+m_laserBeams; r++, angle++){
+	for (unsigned int i=m_initialBeamsSkip; i<m_laserBeams; i++){
+		const double* r=readings+i;
 		skip++;
 		skip=skip>m_likelihoodSkip?0:skip;
 		if (*r>m_usableRange||*r==0.0) continue;
 		if (skip) continue;
-		Point phit=lp;
-		phit.x+=*r*cos(lp.theta+*angle);
-		phit.y+=*r*sin(lp.theta+*angle);
+		Point phit(hitX[i], hitY[i]);
 		IntPoint iphit=map.world2map(phit);
-		Point pfree=lp;
-		pfree.x+=(*r-map.getDelta()*freeDelta)*cos(lp.theta+*angle);
-		pfree.y+=(*r-map.getDelta()*freeDelta)*sin(lp.theta+*angle);
- 		pfree=pfree-phit;
-		IntPoint ipfree=map.world2map(pfree);
+		IntPoint ipfree=map.world2map(Point(-freeStep*dirX[i], -freeStep*dirY[i]));
 		bool found=false;
 		Point bestMu(0.,0.);
 		Point bestCell(0.,0.);
@@ -106,18 +149,19 @@ inline double ScanMatcher::icpStep(OrientedPoint & pret, const ScanMatcherMap& m
 			IntPoint pf=pr+ipfree;
 			//AccessibilityState s=map.storage().cellState(pr);
 			//if (s&Inside && s&Allocated){
-				const PointAccumulator& cell=map.cell(pr);
-				const PointAccumulator& fcell=map.cell(pf);
+				const ScanMatcherCell& cell=map.cell(pr);
+				const ScanMatcherCell& fcell=map.cell(pf);
 				if (((double)cell )> m_fullnessThreshold && ((double)fcell )<m_fullnessThreshold){
-					Point mu=phit-cell.mean();
+					Point mean=cell.mean(map.map2world(pr), map.getDelta());
+					Point mu=phit-mean;
 					if (!found){
 						bestMu=mu;
-						bestCell=cell.mean();
+						bestCell=mean;
 						found=true;
 					}else
 						if((mu*mu)<(bestMu*bestMu)){
 							bestMu=mu;
-							bestCell=cell.mean();
+							bestCell=mean;
 						} 
 						
 				}
@@ -140,40 +184,83 @@ inline double ScanMatcher::icpStep(OrientedPoint & pret, const ScanMatcherMap& m
 	return score(map, p, readings);
 }
 
-inline double ScanMatcher::score(const ScanMatcherMap& map, const OrientedPoint& p, const double* readings) const{
+inline double ScanMatcher::odometryGain(const OrientedPoint& init, const OrientedPoint& p) const{
+	double odo_gain=1;
+	if (m_angularOdometryReliability>0.){
+		double dth=init.theta-p.theta; 	dth=atan2(sin(dth), cos(dth)); 	dth*=dth;
+		odo_gain*=exp(-m_angularOdometryReliability*dth);
+	}
+	if (m_linearOdometryReliability>0.){
+		double dx=init.x-p.x;
+		double dy=init.y-p.y;
+		double drho=dx*dx+dy*dy;
+		odo_gain*=exp(-m_linearOdometryReliability*drho);
+	}
+	return odo_gain;
+}
+
+inline double ScanMatcher::coarseScore(const MapPyramid& pyramid, unsigned int level, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings, const double* dirX, const double* dirY) const{
+	double s=0;
+	OrientedPoint lp=p;
+	lp.x+=cos(p.theta)*m_laserPose.x-sin(p.theta)*m_laserPose.y;
+	lp.y+=sin(p.theta)*m_laserPose.x+cos(p.theta)*m_laserPose.y;
+	double hitX[LASER_MAXBEAMS], hitY[LASER_MAXBEAMS];
+	projectBeams(hitX, hitY, dirX, dirY, readings, m_laserBeams, lp.x, lp.y);
+	unsigned int skip=0;
+	for (unsigned int i=m_initialBeamsSkip; i<m_laserBeams; i++){
+		const double* r=readings+i;
+		skip++;
+		skip=skip>m_likelihoodSkip?0:skip;
+		if (skip||*r>m_usableRange||*r==0.0) continue;
+		s+=pyramid.value(level, map.world2map(Point(hitX[i], hitY[i])));
+	}
+	return s;
+}
+
+inline double ScanMatcher::score(const ScanMatcherMap& map, const OrientedPoint& p, const double* readings, const LikelihoodField* field) const{
+	double dirX[LASER_MAXBEAMS], dirY[LASER_MAXBEAMS];
+	beamDirections(dirX, dirY, p.theta);
+	return score(map, p, readings, dirX, dirY, field);
+}
+
+inline double ScanMatcher::score(const ScanMatcherMap& map, const OrientedPoint& p, const double* readings, const double* dirX, const double* dirY, const LikelihoodField* field) const{
 	double s=0;
-	const double * angle=m_laserAngles+m_initialBeamsSkip;
 	OrientedPoint lp=p;
 	lp.x+=cos(p.theta)*m_laserPose.x-sin(p.theta)*m_laserPose.y;
 	lp.y+=sin(p.theta)*m_laserPose.x+cos(p.theta)*m_laserPose.y;
 	lp.theta+=m_laserPose.theta;
+	double hitX[LASER_MAXBEAMS], hitY[LASER_MAXBEAMS];
+	projectBeams(hitX, hitY, dirX, dirY, readings, m_laserBeams, lp.x, lp.y);
 	unsigned int skip=0;
 	double freeDelta=map.getDelta()*m_freeCellRatio;
-	for (const double* r=readings+m_initialBeamsSkip; r<readings+m_laserBeams; r++, angle++){
+	double freeStep=map.getDelta()*freeDelta;
+	for (unsigned int i=m_initialBeamsSkip; i<m_laserBeams; i++){
+		const double* r=readings+i;
 		skip++;
 		skip=skip>m_likelihoodSkip?0:skip;
 		if (skip||*r>m_usableRange||*r==0.0) continue;
-		Point phit=lp;
-		phit.x+=*r*cos(lp.theta+*angle);
-		phit.y+=*r*sin(lp.theta+*angle);
+		Point phit(hitX[i], hitY[i]);
 		IntPoint iphit=map.world2map(phit);
-		Point pfree=lp;
-		pfree.x+=(*r-map.getDelta()*freeDelta)*cos(lp.theta+*angle);
-		pfree.y+=(*r-map.getDelta()*freeDelta)*sin(lp.theta+*angle);
- 		pfree=pfree-phit;
-		IntPoint ipfree=map.world2map(pfree);
+		IntPoint ipfree=map.world2map(Point(-freeStep*dirX[i], -freeStep*dirY[i]));
 		bool found=false;
 		Point bestMu(0.,0.);
+		if (field){
+			const FieldCell* fc=field->cell(iphit);
+			if (fc && ((double)map.cell(iphit+fc->offset()+ipfree))<m_fullnessThreshold){
+				bestMu=phit-Point(fc->mean.x, fc->mean.y);
+				found=true;
+			}
+		} else
 		for (int xx=-m_kernelSize; xx<=m_kernelSize; xx++)
 		for (int yy=-m_kernelSize; yy<=m_kernelSize; yy++){
 			IntPoint pr=iphit+IntPoint(xx,yy);
 			IntPoint pf=pr+ipfree;
 			//AccessibilityState s=map.storage().cellState(pr);
 			//if (s&Inside && s&Allocated){
-				const PointAccumulator& cell=map.cell(pr);
-				const PointAccumulator& fcell=map.cell(pf);
+				const ScanMatcherCell& cell=map.cell(pr);
+				const ScanMatcherCell& fcell=map.cell(pf);
 				if (((double)cell )> m_fullnessThreshold && ((double)fcell )<m_fullnessThreshold){
-					Point mu=phit-cell.mean();
+					Point mu=phit-cell.mean(map.map2world(pr), map.getDelta());
 					if (!found){
 						bestMu=mu;
 						found=true;
@@ -188,45 +275,50 @@ inline double ScanMatcher::score(const ScanMatcherMap& map, const OrientedPoint&
 	return s;
 }
 
-inline unsigned int ScanMatcher::likelihoodAndScore(double& s, double& l, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings) const{
+inline unsigned int ScanMatcher::likelihoodAndScore(double& s, double& l, const ScanMatcherMap& map, const OrientedPoint& p, const double* readings, const LikelihoodField* field) const{
 	using namespace std;
 	l=0;
 	s=0;
-	const double * angle=m_laserAngles+m_initialBeamsSkip;
 	OrientedPoint lp=p;
 	lp.x+=cos(p.theta)*m_laserPose.x-sin(p.theta)*m_laserPose.y;
 	lp.y+=sin(p.theta)*m_laserPose.x+cos(p.theta)*m_laserPose.y;
 	lp.theta+=m_laserPose.theta;
+	double dirX[LASER_MAXBEAMS], dirY[LASER_MAXBEAMS];
+	double hitX[LASER_MAXBEAMS], hitY[LASER_MAXBEAMS];
+	beamDirections(dirX, dirY, p.theta);
+	projectBeams(hitX, hitY, dirX, dirY, readings, m_laserBeams, lp.x, lp.y);
 	double noHit=nullLikelihood/(m_likelihoodSigma);
 	unsigned int skip=0;
 	unsigned int c=0;
 	double freeDelta=map.getDelta()*m_freeCellRatio;
-	for (const double* r=readings+m_initialBeamsSkip; r<readings+m_laserBeams; r++, angle++){
+	for (unsigned int i=m_initialBeamsSkip; i<m_laserBeams; i++){
+		const double* r=readings+i;
 		skip++;
 		skip=skip>m_likelihoodSkip?0:skip;
 		if (*r>m_usableRange) continue;
 		if (skip) continue;
-		Point phit=lp;
-		phit.x+=*r*cos(lp.theta+*angle);
-		phit.y+=*r*sin(lp.theta+*angle);
+		Point phit(hitX[i], hitY[i]);
 		IntPoint iphit=map.world2map(phit);
-		Point pfree=lp;
-		pfree.x+=(*r-freeDelta)*cos(lp.theta+*angle);
-		pfree.y+=(*r-freeDelta)*sin(lp.theta+*angle);
-		pfree=pfree-phit;
-		IntPoint ipfree=map.world2map(pfree);
+		IntPoint ipfree=map.world2map(Point(-freeDelta*dirX[i], -freeDelta*dirY[i]));
 		bool found=false;
 		Point bestMu(0.,0.);
+		if (field){
+			const FieldCell* fc=field->cell(iphit);
+			if (fc && ((double)map.cell(iphit+fc->offset()+ipfree))<m_fullnessThreshold){
+				bestMu=phit-Point(fc->mean.x, fc->mean.y);
+				found=true;
+			}
+		} else
 		for (int xx=-m_kernelSize; xx<=m_kernelSize; xx++)
 		for (int yy=-m_kernelSize; yy<=m_kernelSize; yy++){
 			IntPoint pr=iphit+IntPoint(xx,yy);
 			IntPoint pf=pr+ipfree;
 			//AccessibilityState s=map.storage().cellState(pr);
 			//if (s&Inside && s&Allocated){
-				const PointAccumulator& cell=map.cell(pr);
-				const PointAccumulator& fcell=map.cell(pf);
+				const ScanMatcherCell& cell=map.cell(pr);
+				const ScanMatcherCell& fcell=map.cell(pf);
 				if (((double)cell )>m_fullnessThreshold && ((double)fcell )<m_fullnessThreshold){
-					Point mu=phit-cell.mean();
+					Point mu=phit-cell.mean(map.map2world(pr), map.getDelta());
 					if (!found){
 						bestMu=mu;
 						found=true;
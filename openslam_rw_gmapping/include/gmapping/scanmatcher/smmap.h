@@ -16,8 +16,10 @@ struct PointAccumulator{
 	PointAccumulator(): acc(0,0), n(0), visits(0){}
 	PointAccumulator(int i): acc(0,0), n(0), visits(0){assert(i==-1);}
 	/*after end*/
-        inline void update(bool value, const Point& p=Point(0,0));
+        inline void update(bool value, const Point& p=Point(0,0), const Point& center=Point(0,0), double delta=0);
 	inline Point mean() const {return 1./n*Point(acc.x, acc.y);}
+	/**the cell keeps the hits in world coordinates, the center and the size of the cell are not needed*/
+	inline Point mean(const Point&, double) const {return mean();}
 	inline operator double() const { return visits?(double)n*SIGHT_INC/(double)visits:-1; }
 	inline void add(const PointAccumulator& p) {acc=acc+p.acc; n+=p.n; visits+=p.visits; }
 	static const PointAccumulator& Unknown();
@@ -27,7 +29,7 @@ struct PointAccumulator{
 	inline double entropy() const;
 };
 
-void PointAccumulator::update(bool value, const Point& p){
+void PointAccumulator::update(bool value, const Point& p, const Point&, double){
 	if (value) {
 		acc.x+= static_cast<float>(p.x);
 		acc.y+= static_cast<float>(p.y); 
@@ -46,8 +48,65 @@ double PointAccumulator::entropy() const{
 	return -( x*log(x)+ (1-x)*log(1-x) );
 }
 
+/**A cell with the interface of the PointAccumulator in 8 bytes instead of 16.
+The counts are 16 bit, and the hits are kept as the running mean of their offset from
+the center of the cell, quantized to 1/65534 of the cell size per axis; update() and
+mean() thus take the center and the size of the cell from the map.
+The rounding of the running mean puts it off the exact mean of the hits by at most
+n/262000 of a cell after n hits, 0.2mm after 1000 hits on a 5cm grid, which is the order
+of the rounding of the float sums of the PointAccumulator. The occupancy is exact until
+the cell has been visited 65535 times; past that both the counts are halved, which
+changes the occupancy by less than 1/30000.*/
+struct CompactPointAccumulator{
+	CompactPointAccumulator(): ox(0), oy(0), n(0), visits(0){}
+	CompactPointAccumulator(int i): ox(0), oy(0), n(0), visits(0){assert(i==-1);}
+	inline void update(bool value, const Point& p=Point(0,0), const Point& center=Point(0,0), double delta=0);
+	inline Point mean(const Point& center, double delta) const {return center+(delta/OffsetScale)*Point(ox, oy);}
+	inline operator double() const { return visits?(double)n*SIGHT_INC/(double)visits:-1; }
+	static const CompactPointAccumulator& Unknown();
+	static CompactPointAccumulator* unknown_ptr;
+	enum {OffsetScale=65534, CountLimit=0xffff};
+	short ox, oy;
+	unsigned short n, visits;
+	inline double entropy() const;
+};
+
+void CompactPointAccumulator::update(bool value, const Point& p, const Point& center, double delta){
+	if (visits>CountLimit-SIGHT_INC){
+		n>>=1;
+		visits>>=1;
+	}
+	if (value) {
+		assert(delta>0);
+		n++;
+		visits+=SIGHT_INC;
+		double qx=(p.x-center.x)/delta*OffsetScale, qy=(p.y-center.y)/delta*OffsetScale;
+		qx=ox+(qx-ox)/n;
+		qy=oy+(qy-oy)/n;
+		ox=(short)floor((qx>OffsetScale/2?OffsetScale/2:qx<-OffsetScale/2?-OffsetScale/2:qx)+.5);
+		oy=(short)floor((qy>OffsetScale/2?OffsetScale/2:qy<-OffsetScale/2?-OffsetScale/2:qy)+.5);
+	} else
+		visits++;
+}
+
+double CompactPointAccumulator::entropy() const{
+	if (!visits)
+		return -log(.5);
+	if (n==visits || n==0)
+		return 0;
+	double x=(double)n*SIGHT_INC/(double)visits;
+	return -( x*log(x)+ (1-x)*log(1-x) );
+}
+
+/**The cell of the scan matcher maps, the PointAccumulator unless GMAPPING_COMPACT_CELLS is
+defined. Every library and node including this header has to be built with the same choice.*/
+#ifdef GMAPPING_COMPACT_CELLS
+typedef CompactPointAccumulator ScanMatcherCell;
+#else
+typedef PointAccumulator ScanMatcherCell;
+#endif
 
-typedef Map<PointAccumulator,HierarchicalArray2D<PointAccumulator> > ScanMatcherMap;
+typedef Map<ScanMatcherCell,HierarchicalArray2D<ScanMatcherCell> > ScanMatcherMap;
 
 };
 
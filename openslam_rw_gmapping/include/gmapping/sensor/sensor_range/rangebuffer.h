@@ -0,0 +1,75 @@
+#ifndef RANGEBUFFER_H
+#define RANGEBUFFER_H
+
+#include <stddef.h>
+#include <vector>
+#include <limits>
+#include <gmapping/utils/autoptr.h>
+
+namespace GMapping{
+
+/**The ranges of a scan as kept by the trajectory tree, which holds one for each processed scan
+for as long as some particle descends from it. The ranges are stored either as floats, which
+keep about 7 significant digits, or quantized to 16 bit multiples of a resolution, which keep
+them within half a resolution up to 65534 resolutions (65.5m at 1mm); the ranges beyond, and
+the infinite ones, read back as infinite, and the NaN ones as 0, both of which the scan matcher
+skips. A buffer is built once per scan and shared by all the nodes of that scan through a
+RangeBufferPtr, so that it is freed when the last of them is pruned.*/
+class RangeBuffer{
+	public:
+		enum Encoding{Float, Quantized};
+
+		/**a buffer of size ranges, all 0 until they are set(), so that a scan can be encoded
+		straight from the ranges of its source*/
+		RangeBuffer(unsigned int size, Encoding encoding=Float, double resolution=0.001);
+		RangeBuffer(const double* ranges, unsigned int size, Encoding encoding=Float, double resolution=0.001);
+
+		inline unsigned int size() const {return m_size;}
+		inline Encoding getEncoding() const {return m_encoding;}
+		inline double getResolution() const {return m_resolution;}
+		inline double operator[](unsigned int i) const;
+		/**encodes the range of the beam i*/
+		inline void set(unsigned int i, double range);
+
+		/**writes the size() ranges to the given array*/
+		void decode(double* ranges) const;
+
+		/**releases the ranges, leaving an empty buffer to all the nodes sharing it*/
+		void clear();
+
+		/**@returns the bytes held by the buffer*/
+		size_t bytes() const;
+
+	protected:
+		enum {OutOfRange=0xffff};
+		void init(unsigned int size, Encoding encoding, double resolution);
+		Encoding m_encoding;
+		double m_resolution;
+		unsigned int m_size;
+		std::vector<float> m_floats;
+		std::vector<unsigned short> m_codes;
+};
+
+typedef atomic_autoptr<RangeBuffer> RangeBufferPtr;
+
+inline double RangeBuffer::operator[](unsigned int i) const{
+	if (m_encoding==Float)
+		return m_floats[i];
+	unsigned short c=m_codes[i];
+	return c==OutOfRange?std::numeric_limits<double>::infinity():c*m_resolution;
+}
+
+inline void RangeBuffer::set(unsigned int i, double r){
+	if (m_encoding==Float)
+		m_floats[i]=(float)r;
+	else if (r!=r || r<=0)
+		m_codes[i]=0;
+	else if (r>=(OutOfRange-0.5)*m_resolution)
+		m_codes[i]=OutOfRange;
+	else
+		m_codes[i]=(unsigned short)(r/m_resolution+0.5);
+}
+
+};
+
+#endif
@@ -9,11 +9,18 @@ class autoptr{
 	protected:
 	
 	public:
+	/**the shared state of the pointers to the same object.
+	When release is not set, the object and the reference are allocated with new.
+	Otherwise the reference is intrusive, i.e. allocated together with the object by
+	someone else, and release() destroys both when the last pointer goes away.*/
 	struct reference{
 		X* data;
 		unsigned int shares;
+		void (*release)(reference*);
 	};
 		inline autoptr(X* p=(X*)(0));
+		/**builds a pointer sharing an intrusive reference, whose shares are incremented*/
+		static inline autoptr attach(reference* r);
 		inline autoptr(const autoptr<X>& ap);
 		inline autoptr& operator=(const autoptr<X>& ap);
 		inline ~autoptr();
@@ -23,6 +30,7 @@ class autoptr{
 		//p	
 		reference * m_reference;
 	protected:
+		inline void release();
 };
 
 template <class X>
@@ -32,9 +40,33 @@ autoptr<X>::autoptr(X* p){
 		m_reference=new reference;
 		m_reference->data=p;
 		m_reference->shares=1;
+		m_reference->release=0;
 	}
 }
 
+template <class X>
+autoptr<X> autoptr<X>::attach(reference* r){
+	autoptr<X> ap;
+	if (r){
+		ap.m_reference=r;
+		r->shares++;
+	}
+	return ap;
+}
+
+template <class X>
+void autoptr<X>::release(){
+	if (m_reference && !(--m_reference->shares)){
+		if (m_reference->release){
+			m_reference->release(m_reference);
+		} else {
+			delete m_reference->data;
+			delete m_reference;
+		}
+	}
+	m_reference=0;
+}
+
 template <class X>
 autoptr<X>::autoptr(const autoptr<X>& ap){
 	m_reference=0;
@@ -51,11 +83,7 @@ autoptr<X>& autoptr<X>::operator=(const autoptr<X>& ap){
 	if (m_reference==ref){
 		return *this;
 	}
-	if (m_reference && !(--m_reference->shares)){
-		delete m_reference->data;
-		delete m_reference;
-		m_reference=0;
-	}	
+	release();
 	if (ref){
 		m_reference=ref;
 		m_reference->shares++;
@@ -69,11 +97,7 @@ autoptr<X>& autoptr<X>::operator=(const autoptr<X>& ap){
 
 template <class X>
 autoptr<X>::~autoptr(){
-	if (m_reference && !(--m_reference->shares)){
-		delete m_reference->data;
-		delete m_reference;
-		m_reference=0;
-	}	
+	release();
 }
 
 template <class X>
@@ -93,5 +117,140 @@ const X& autoptr<X>::operator*() const{
 	return *(m_reference->data);
 }
 
+/**An autoptr whose reference counter is updated with atomic operations, so that the copies
+of a pointer can be made and dropped concurrently by different threads, e.g. the patches
+shared by the maps of particles processed in parallel. Accessing the pointed object is not
+synchronized. The reference has the same layout of the autoptr one.
+In C++11 a pointer can be moved, which does not touch the counter.*/
+template <class X>
+class atomic_autoptr{
+	public:
+		typedef typename autoptr<X>::reference reference;
+		inline atomic_autoptr(X* p=(X*)(0));
+		/**builds a pointer sharing an intrusive reference, whose shares are incremented*/
+		static inline atomic_autoptr attach(reference* r);
+		inline atomic_autoptr(const atomic_autoptr<X>& ap);
+		inline atomic_autoptr& operator=(const atomic_autoptr<X>& ap);
+#if __cplusplus >= 201103L
+		inline atomic_autoptr(atomic_autoptr<X>&& ap);
+		inline atomic_autoptr& operator=(atomic_autoptr<X>&& ap);
+#endif
+		inline ~atomic_autoptr();
+		inline void swap(atomic_autoptr<X>& ap);
+		/**@returns true if this is the only pointer to the object*/
+		inline bool unique() const;
+		inline operator int() const;
+		inline X& operator*();
+		inline const X& operator*() const;
+		reference * m_reference;
+	protected:
+		inline void release();
+};
+
+template <class X>
+atomic_autoptr<X>::atomic_autoptr(X* p){
+	m_reference=0;
+	if (p){
+		m_reference=new reference;
+		m_reference->data=p;
+		m_reference->shares=1;
+		m_reference->release=0;
+	}
+}
+
+template <class X>
+atomic_autoptr<X> atomic_autoptr<X>::attach(reference* r){
+	atomic_autoptr<X> ap;
+	if (r){
+		__sync_add_and_fetch(&r->shares, 1);
+		ap.m_reference=r;
+	}
+	return ap;
+}
+
+template <class X>
+void atomic_autoptr<X>::release(){
+	if (m_reference && !__sync_sub_and_fetch(&m_reference->shares, 1)){
+		if (m_reference->release){
+			m_reference->release(m_reference);
+		} else {
+			delete m_reference->data;
+			delete m_reference;
+		}
+	}
+	m_reference=0;
+}
+
+template <class X>
+atomic_autoptr<X>::atomic_autoptr(const atomic_autoptr<X>& ap){
+	m_reference=ap.m_reference;
+	if (m_reference)
+		__sync_add_and_fetch(&m_reference->shares, 1);
+}
+
+template <class X>
+atomic_autoptr<X>& atomic_autoptr<X>::operator=(const atomic_autoptr<X>& ap){
+	reference* ref=ap.m_reference;
+	if (m_reference==ref)
+		return *this;
+	if (ref)
+		__sync_add_and_fetch(&ref->shares, 1);
+	release();
+	m_reference=ref;
+	return *this;
+}
+
+#if __cplusplus >= 201103L
+template <class X>
+atomic_autoptr<X>::atomic_autoptr(atomic_autoptr<X>&& ap){
+	m_reference=ap.m_reference;
+	ap.m_reference=0;
+}
+
+template <class X>
+atomic_autoptr<X>& atomic_autoptr<X>::operator=(atomic_autoptr<X>&& ap){
+	if (this!=&ap){
+		release();
+		m_reference=ap.m_reference;
+		ap.m_reference=0;
+	}
+	return *this;
+}
+#endif
+
+template <class X>
+atomic_autoptr<X>::~atomic_autoptr(){
+	release();
+}
+
+template <class X>
+void atomic_autoptr<X>::swap(atomic_autoptr<X>& ap){
+	reference* ref=m_reference;
+	m_reference=ap.m_reference;
+	ap.m_reference=ref;
+}
+
+template <class X>
+bool atomic_autoptr<X>::unique() const{
+	return m_reference && __sync_add_and_fetch(&m_reference->shares, 0)==1;
+}
+
+template <class X>
+atomic_autoptr<X>::operator int() const{
+	return m_reference && m_reference->shares && m_reference->data;
+}
+
+template <class X>
+X& atomic_autoptr<X>::operator*(){
+	assert(m_reference && m_reference->shares && m_reference->data);
+	return *(m_reference->data);
+}
+
+template <class X>
+const X& atomic_autoptr<X>::operator*() const{
+	assert(m_reference && m_reference->shares && m_reference->data);
+	return *(m_reference->data);
+}
+
 };
 #endif
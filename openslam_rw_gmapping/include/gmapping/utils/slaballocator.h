@@ -0,0 +1,78 @@
+#ifndef SLABALLOCATOR_H
+#define SLABALLOCATOR_H
+
+#include <stddef.h>
+#include <vector>
+
+namespace GMapping {
+
+/**An allocator of blocks of a single size. Blocks are carved out of large slabs and the
+freed blocks are kept in a free list and handed out again, so after the warm up the
+allocator does not touch the heap anymore. Slabs are returned to the heap only when the
+allocator is destroyed. Slabs are aligned to a cache line, and so are the blocks unless
+a smaller alignment is asked for, which packs small blocks tighter.
+allocate() and deallocate() can be called concurrently.*/
+class SlabAllocator{
+	public:
+		enum {Alignment=64};
+
+		struct Statistics{
+			size_t blockSize;
+			unsigned int blocksPerSlab;
+			unsigned int slabs;
+			/**blocks in all the slabs*/
+			unsigned int capacity;
+			/**blocks handed out and not released yet*/
+			unsigned int used;
+			/**highest value reached by used*/
+			unsigned int peak;
+			/**calls to allocate()*/
+			unsigned long allocations;
+			/**calls to allocate() served with a block freed before*/
+			unsigned long recycled;
+			inline size_t bytes() const {return (size_t)capacity*blockSize;}
+		};
+
+		SlabAllocator(size_t blockSize, unsigned int blocksPerSlab=256, size_t alignment=Alignment);
+		~SlabAllocator();
+
+		void* allocate();
+		void deallocate(void* block);
+
+		/**makes sure that the given number of blocks can be in use without allocating new slabs.
+		The missing blocks are allocated as a single slab.*/
+		void reserve(unsigned int blocks);
+		/**changes the size of the slabs allocated from now on*/
+		void setBlocksPerSlab(unsigned int blocks);
+
+		Statistics statistics() const;
+		inline size_t blockSize() const {return m_blockSize;}
+
+	protected:
+		struct FreeBlock{
+			FreeBlock* next;
+		};
+
+		void grow(unsigned int blocks);
+		inline void lock() const {while (__sync_lock_test_and_set(&m_lock, 1)) ;}
+		inline void unlock() const {__sync_lock_release(&m_lock);}
+
+		size_t m_blockSize;
+		unsigned int m_blocksPerSlab;
+		std::vector<char*> m_slabs;
+		FreeBlock* m_free;
+		//blocks of the last slab never handed out
+		char* m_fresh;
+		unsigned int m_freshBlocks;
+		unsigned int m_capacity, m_used, m_peak;
+		unsigned long m_allocations, m_recycled;
+		mutable volatile int m_lock;
+
+	private:
+		SlabAllocator(const SlabAllocator&);
+		SlabAllocator& operator=(const SlabAllocator&);
+};
+
+};
+
+#endif
@@ -15,6 +15,23 @@ double evalLogGaussian(double sigmaSquare, double delta);
 int sampleUniformInt(int max);
 double sampleUniformDouble(double min, double max);
 
+/**A source of zero mean, unit variance normal samples with its own random state, unlike
+sampleGaussian which uses the global drand48 one. Different samplers can be drawn from
+concurrently, and the same seed always gives the same samples.
+The samples are drawn in batches: the uniform numbers first, then the trigonometric
+Box-Muller transform turns them into pairs of normal samples in a loop without branches.*/
+class GaussianSampler{
+	public:
+		GaussianSampler(unsigned long seed=0);
+		/**restarts the random state, which then gives the uniform numbers drand48() gives after srand48(seed)*/
+		void seed(unsigned long seed);
+		/**draws n samples into a buffer owned by the sampler, valid until the next call*/
+		const double* samples(unsigned int n);
+	protected:
+		unsigned short m_state[3];
+		std::vector<double> m_samples;
+};
+
 struct Covariance3{
 	Covariance3 operator + (const Covariance3 & cov) const;
 	static Covariance3 zero;
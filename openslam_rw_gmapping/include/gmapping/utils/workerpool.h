@@ -0,0 +1,73 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <pthread.h>
+#include <vector>
+
+namespace GMapping {
+
+/**A persistent pool of worker threads executing an indexed loop.
+The thread calling run() takes part in the work as worker 0, so a pool of size 1
+does not spawn any thread and runs the loop serially.
+Indexes are handed out dynamically, so the workers stay busy even if the cost of the
+single iterations is not uniform.*/
+class WorkerPool{
+	public:
+		/**The body of the loop. run(index, worker) is invoked once per index,
+		worker is in [0, size()) and can be used to address per-thread state.*/
+		struct Task{
+			virtual ~Task(){}
+			virtual void run(unsigned int index, unsigned int worker)=0;
+		};
+
+		WorkerPool(unsigned int threads=1);
+		~WorkerPool();
+
+		/**changes the number of workers, 0 means one worker per online cpu*/
+		void resize(unsigned int threads);
+		inline unsigned int size() const {return m_size;}
+
+		/**executes task.run() for all the indexes in [0, count) and returns when all of them are done*/
+		void run(Task& task, unsigned int count);
+
+		/**@returns the number of online cpus*/
+		static unsigned int hardwareConcurrency();
+
+	protected:
+		void start(unsigned int threads);
+		void stop();
+		void work(unsigned int worker);
+		static void* threadMain(void* arg);
+
+		struct Worker{
+			WorkerPool* pool;
+			unsigned int index;
+			//the job generation when the worker was started, a worker only runs the jobs after it
+			unsigned int generation;
+			pthread_t thread;
+		};
+
+		unsigned int m_size;
+		std::vector<Worker> m_workers;
+		pthread_mutex_t m_mutex;
+		pthread_cond_t m_startCond;
+		pthread_cond_t m_doneCond;
+
+		//state of the current job, protected by m_mutex
+		Task* m_task;
+		unsigned int m_count;
+		unsigned int m_generation;
+		unsigned int m_busy;
+		bool m_quit;
+
+		//next index to be processed
+		volatile unsigned int m_next;
+
+	private:
+		WorkerPool(const WorkerPool&);
+		WorkerPool& operator=(const WorkerPool&);
+};
+
+};
+
+#endif
@@ -1,4 +1,4 @@
-#include "configuration.h"
+#include <gmapping/log/configuration.h>
 
 namespace GMapping {
 
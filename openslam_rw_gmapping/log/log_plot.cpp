@@ -2,8 +2,8 @@
 #include <fstream>
 #include <iostream>
 #include <sys/types.h>
-#include <log/carmenconfiguration.h>
-#include <log/sensorlog.h>
+#include <gmapping/log/carmenconfiguration.h>
+#include <gmapping/log/sensorlog.h>
 
 
 using namespace std;
@@ -1,8 +1,8 @@
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
-#include <log/carmenconfiguration.h>
-#include <log/sensorlog.h>
+#include <gmapping/log/carmenconfiguration.h>
+#include <gmapping/log/sensorlog.h>
 
 
 using namespace std;
@@ -0,0 +1,155 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <sys/time.h>
+#include <gmapping/log/carmenconfiguration.h>
+#include <gmapping/log/sensorstream.h>
+#include <gmapping/scanmatcher/scanmatcher.h>
+#include "gridlinetraversal.h"
+
+using namespace std;
+using namespace GMapping;
+
+/*replays the laser scans of a carmen log and measures the computation of the active area,
+i.e. of the patches touched by the beams of a scan: the std::set the scan matcher used to fill
+against the sorted vector ScanMatcher::computeActiveArea builds now.
+Both walk the same beams; the map is grown over the whole log before timing, so that
+neither of them pays for resizing it.*/
+
+typedef HierarchicalArray2D<ScanMatcherCell>::PointSet PointSet;
+typedef HierarchicalArray2D<ScanMatcherCell>::PointList PointList;
+
+struct Scan{
+	OrientedPoint pose;
+	vector<double> readings;
+};
+
+static double now(){
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec+1e-6*tv.tv_usec;
+}
+
+//the active area as collected before, one set insertion per traversed cell
+static void setActiveArea(PointSet& activeArea, ScanMatcherMap& map, const OrientedPoint& p, const double* readings,
+		const vector<double>& angles, double maxRange, double usableRange, IntPoint* linePoints){
+	activeArea.clear();
+	IntPoint p0=map.world2map(p);
+	for (unsigned int i=0; i<angles.size(); i++){
+		double d=readings[i];
+		if (d>maxRange||d==0.0||isnan(d))
+			continue;
+		if (d>usableRange)
+			d=usableRange;
+		Point phit=p+Point(d*cos(p.theta+angles[i]),d*sin(p.theta+angles[i]));
+		IntPoint p1=map.world2map(phit);
+		GridLineTraversalLine line;
+		line.points=linePoints;
+		GridLineTraversal::gridLine(p0, p1, &line);
+		for (int j=0; j<line.num_points-1; j++)
+			activeArea.insert(map.storage().patchIndexes(linePoints[j]));
+		if (d<usableRange)
+			activeArea.insert(map.storage().patchIndexes(p1));
+	}
+	map.storage().setActiveArea(activeArea, true);
+}
+
+int main(int argc, const char * const * argv){
+	if (argc<2){
+		cout << "usage: activearea_bench <carmen log> [delta] [maxUrange] [repeats]" << endl;
+		return -1;
+	}
+	const char* filename=argv[1];
+	double delta=argc>2?atof(argv[2]):0.05;
+	double maxUrange=argc>3?atof(argv[3]):15.;
+	int repeats=argc>4?atoi(argv[4]):5;
+
+	ifstream is(filename);
+	if (!is){
+		cout << "no file found" << endl;
+		return -1;
+	}
+	CarmenConfiguration conf;
+	conf.load(is);
+	is.close();
+	SensorMap sensorMap=conf.computeSensorMap();
+
+	//load the scans of the front laser
+	vector<Scan> scans;
+	const RangeSensor* sensor=0;
+	ifstream plainStream(filename);
+	InputSensorStream input(sensorMap, plainStream);
+	while (input){
+		const SensorReading* r;
+		input >> r;
+		const RangeReading* rr=dynamic_cast<const RangeReading*>(r);
+		if (rr && (!sensor || rr->getSensor()==sensor)){
+			sensor=dynamic_cast<const RangeSensor*>(rr->getSensor());
+			Scan s;
+			s.pose=rr->getPose();
+			s.readings.assign(rr->begin(), rr->end());
+			scans.push_back(s);
+		}
+		delete r;
+	}
+	if (!sensor){
+		cout << "no laser scans in the log" << endl;
+		return -1;
+	}
+
+	vector<double> angles;
+	for (unsigned int i=0; i<sensor->beams().size(); i++)
+		angles.push_back(sensor->beams()[i].pose.theta);
+	double maxRange=sensor->beams()[0].maxRange;
+	ScanMatcher matcher;
+	matcher.setLaserParameters(angles.size(), &angles[0], OrientedPoint(0,0,0));
+	matcher.setMatchingParameters(maxUrange, maxRange, 0.05, 1, 0.05, 0.05, 5);
+	matcher.setgenerateMap(true);
+
+	ScanMatcherMap map(Point(0,0), 100, 100, delta);
+	for (unsigned int i=0; i<scans.size(); i++){
+		matcher.invalidateActiveArea();
+		matcher.computeActiveArea(map, scans[i].pose, &scans[i].readings[0]);
+	}
+	cout << scans.size() << " scans of " << angles.size() << " beams, map " << map.getMapSizeX() << "x" << map.getMapSizeY()
+		<< " cells of " << delta << "m" << endl;
+
+	vector<IntPoint> linePoints(20000);
+	PointSet set;
+	double ts=0, tl=0;
+	unsigned long patches=0;
+	bool same=true;
+	for (int r=0; r<repeats; r++){
+		double t=now();
+		for (unsigned int i=0; i<scans.size(); i++)
+			setActiveArea(set, map, scans[i].pose, &scans[i].readings[0], angles, maxRange, maxUrange, &linePoints[0]);
+		ts+=now()-t;
+		t=now();
+		for (unsigned int i=0; i<scans.size(); i++){
+			matcher.invalidateActiveArea();
+			matcher.computeActiveArea(map, scans[i].pose, &scans[i].readings[0]);
+			patches+=map.storage().getActiveArea().size();
+		}
+		tl+=now()-t;
+	}
+	//check that both give the same patches
+	for (unsigned int i=0; i<scans.size(); i++){
+		setActiveArea(set, map, scans[i].pose, &scans[i].readings[0], angles, maxRange, maxUrange, &linePoints[0]);
+		PointList expected(set.begin(), set.end());
+		matcher.invalidateActiveArea();
+		matcher.computeActiveArea(map, scans[i].pose, &scans[i].readings[0]);
+		const PointList& computed=map.storage().getActiveArea();
+		same=same && expected.size()==computed.size();
+		for (unsigned int j=0; same && j<computed.size(); j++)
+			same=expected[j].x==computed[j].x && expected[j].y==computed[j].y;
+	}
+	cout << "average active area " << (double)patches/(repeats*scans.size()) << " patches" << endl;
+	cout << "std::set      " << 1e6*ts/(repeats*scans.size()) << " us/scan" << endl;
+	cout << "sorted vector " << 1e6*tl/(repeats*scans.size()) << " us/scan" << endl;
+	if (!same){
+		cerr << "the active areas differ" << endl;
+		return 1;
+	}
+	return 0;
+}
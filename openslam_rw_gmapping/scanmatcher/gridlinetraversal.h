@@ -14,6 +14,10 @@ typedef struct {
 struct GridLineTraversal {
   inline static void gridLine( IntPoint start, IntPoint end, GridLineTraversalLine *line ) ;
   inline static void gridLineCore( IntPoint start, IntPoint end, GridLineTraversalLine *line ) ;
+  /**calls visit(p) for the cells of the line from start to end, in this order, without storing them.
+  The cells are the ones gridLine() returns. The last cell, end, is visited only if includeEnd is set.*/
+  template <class Visitor>
+  inline static void visitLine( IntPoint start, IntPoint end, Visitor& visit, bool includeEnd=true ) ;
 
 };
 
@@ -123,6 +127,70 @@ void GridLineTraversal::gridLine( IntPoint start, IntPoint end, GridLineTraversa
   }
 }
 
+template <class Visitor>
+void GridLineTraversal::visitLine( IntPoint start, IntPoint end, Visitor& visit, bool includeEnd )
+{
+  int dx, dy, incr1, incr2, d, xstep, ystep;
+  IntPoint p=start;
+
+  dx = abs(end.x-start.x); dy = abs(end.y-start.y);
+  xstep = end.x > start.x ? 1 : -1;
+  ystep = end.y > start.y ? 1 : -1;
+
+  /* gridLineCore() always walks from the endpoint with the lower x (lower y for the steep lines).
+     When that is end, its steps are undone from start: the error term ends where it begins, and
+     it never falls in the range reached by both kinds of step, so the same cells are visited. */
+  if (dy <= dx) {
+    d = 2*dy - dx; incr1 = 2 * dy; incr2 = 2 * (dy - dx);
+    if (xstep > 0) {
+      while (p.x != end.x) {
+	visit(p);
+	p.x++;
+	if (d < 0) {
+	  d+=incr1;
+	} else {
+	  p.y+=ystep; d+=incr2;
+	}
+      }
+    } else {
+      while (p.x != end.x) {
+	visit(p);
+	p.x--;
+	if (d >= incr1+incr2) {
+	  d-=incr1;
+	} else {
+	  p.y+=ystep; d-=incr2;
+	}
+      }
+    }
+  } else {
+    d = 2*dx - dy; incr1 = 2 * dx; incr2 = 2 * (dx - dy);
+    if (ystep > 0) {
+      while (p.y != end.y) {
+	visit(p);
+	p.y++;
+	if (d < 0) {
+	  d+=incr1;
+	} else {
+	  p.x+=xstep; d+=incr2;
+	}
+      }
+    } else {
+      while (p.y != end.y) {
+	visit(p);
+	p.y--;
+	if (d >= incr1+incr2) {
+	  d-=incr1;
+	} else {
+	  p.x+=xstep; d-=incr2;
+	}
+      }
+    }
+  }
+  if (includeEnd)
+    visit(p);
+}
+
 };
 
 #endif
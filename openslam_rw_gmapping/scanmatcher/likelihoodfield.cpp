@@ -0,0 +1,117 @@
+#include <limits>
+#include <gmapping/scanmatcher/likelihoodfield.h>
+
+namespace GMapping {
+
+using namespace std;
+
+LikelihoodField::LikelihoodField(): m_storage(0,0), m_origin(0,0){
+	m_delta=0;
+	m_valid=false;
+	m_kernelSize=0;
+	m_fullnessThreshold=0;
+}
+
+void LikelihoodField::clear(){
+	m_storage=HierarchicalArray2D<FieldCell>(0,0);
+	m_valid=false;
+}
+
+void LikelihoodField::swap(LikelihoodField& field){
+	m_storage.swap(field.m_storage);
+	std::swap(m_origin, field.m_origin);
+	std::swap(m_delta, field.m_delta);
+	std::swap(m_valid, field.m_valid);
+	std::swap(m_kernelSize, field.m_kernelSize);
+	std::swap(m_fullnessThreshold, field.m_fullnessThreshold);
+}
+
+void LikelihoodField::update(const ScanMatcherMap& map, int kernelSize, double fullnessThreshold){
+	const HierarchicalArray2D<ScanMatcherCell>& storage=map.storage();
+	if (m_valid && kernelSize==m_kernelSize && fullnessThreshold==m_fullnessThreshold && map.getDelta()==m_delta){
+		follow(map);
+		build(map, storage.getActiveArea());
+		return;
+	}
+	
+	//(re)build the field over all the allocated patches of the map
+	m_storage=HierarchicalArray2D<FieldCell>(map.getMapSizeX(), map.getMapSizeY(), storage.getPatchMagnitude());
+	m_origin=map.map2world(0,0);
+	m_delta=map.getDelta();
+	m_kernelSize=kernelSize;
+	m_fullnessThreshold=fullnessThreshold;
+	m_valid=true;
+	HierarchicalArray2D<FieldCell>::PointList allocated;
+	for (int x=0; x<storage.getXSize(); x++)
+		for (int y=0; y<storage.getYSize(); y++)
+			if (storage.m_cells[x][y])
+				allocated.push_back(IntPoint(x,y));
+	build(map, allocated);
+}
+
+void LikelihoodField::follow(const ScanMatcherMap& map){
+	if (!m_valid)
+		return;
+	//the map grows by whole patches, shift the field by the same amount
+	const HierarchicalArray2D<ScanMatcherCell>& storage=map.storage();
+	double patchWorldSize=m_delta*(1<<storage.getPatchMagnitude());
+	Point origin=map.map2world(0,0);
+	int dx=(int)round((origin.x-m_origin.x)/patchWorldSize);
+	int dy=(int)round((origin.y-m_origin.y)/patchWorldSize);
+	if (dx || dy || m_storage.getXSize()!=storage.getXSize() || m_storage.getYSize()!=storage.getYSize())
+		m_storage.resize(dx, dy, dx+storage.getXSize(), dy+storage.getYSize());
+	m_origin=origin;
+}
+
+void LikelihoodField::build(const ScanMatcherMap& map, const HierarchicalArray2D<FieldCell>::PointList& patches){
+	typedef HierarchicalArray2D<FieldCell>::PointList PointList;
+	int magnitude=m_storage.getPatchMagnitude();
+	int k=m_kernelSize;
+	int reach=k>0?1:0;
+	
+	//the cells within the kernel of a changed patch may lie in the neighboring patches
+	PointList touched;
+	for (PointList::const_iterator it=patches.begin(); it!=patches.end(); ++it)
+		for (int px=it->x-reach; px<=it->x+reach; px++)
+			for (int py=it->y-reach; py<=it->y+reach; py++)
+				if (m_storage.isInside(px, py))
+					touched.push_back(IntPoint(px,py));
+	HierarchicalArray2D<FieldCell>::makeUnique(touched);
+	m_storage.setActiveArea(touched, true);
+	m_storage.allocActiveArea();
+	
+	for (PointList::const_iterator it=patches.begin(); it!=patches.end(); ++it){
+		int xmin=(it->x<<magnitude)-k, xmax=((it->x+1)<<magnitude)+k;
+		int ymin=(it->y<<magnitude)-k, ymax=((it->y+1)<<magnitude)+k;
+		xmin=xmin<0?0:xmin;
+		ymin=ymin<0?0:ymin;
+		xmax=xmax>map.getMapSizeX()?map.getMapSizeX():xmax;
+		ymax=ymax>map.getMapSizeY()?map.getMapSizeY():ymax;
+		for (int x=xmin; x<xmax; x++)
+			for (int y=ymin; y<ymax; y++){
+				Point center=map.map2world(x,y);
+				FieldCell& fc=m_storage.cell(x,y);
+				fc.valid=false;
+				double bestDistance=numeric_limits<double>::max();
+				for (int xx=-k; xx<=k; xx++)
+					for (int yy=-k; yy<=k; yy++){
+						IntPoint c(x+xx,y+yy);
+						const ScanMatcherCell& cell=map.cell(c);
+						if (((double)cell)>m_fullnessThreshold){
+							Point mean=cell.mean(map.map2world(c), map.getDelta());
+							Point delta=center-mean;
+							double distance=delta*delta;
+							if (distance<bestDistance){
+								bestDistance=distance;
+								fc.mean=FieldCell::FloatPoint((float)mean.x, (float)mean.y);
+								fc.dx=(signed char)xx;
+								fc.dy=(signed char)yy;
+								fc.valid=true;
+							}
+						}
+					}
+			}
+	}
+}
+
+};
@@ -0,0 +1,110 @@
+#include <gmapping/scanmatcher/mappyramid.h>
+
+namespace GMapping {
+
+using namespace std;
+
+MapPyramid::MapPyramid(): m_origin(0,0){
+	m_delta=0;
+	m_fullnessThreshold=0;
+	m_valid=false;
+}
+
+void MapPyramid::clear(){
+	m_levels.clear();
+	m_valid=false;
+}
+
+void MapPyramid::swap(MapPyramid& pyramid){
+	m_levels.swap(pyramid.m_levels);
+	std::swap(m_origin, pyramid.m_origin);
+	std::swap(m_delta, pyramid.m_delta);
+	std::swap(m_fullnessThreshold, pyramid.m_fullnessThreshold);
+	std::swap(m_valid, pyramid.m_valid);
+}
+
+size_t MapPyramid::getTableBytes() const{
+	size_t bytes=m_levels.size()*sizeof(Level);
+	for (unsigned int l=0; l<m_levels.size(); l++)
+		bytes+=m_levels[l].getTableBytes();
+	return bytes;
+}
+
+void MapPyramid::update(const ScanMatcherMap& map, unsigned int levels, double fullnessThreshold){
+	const HierarchicalArray2D<ScanMatcherCell>& storage=map.storage();
+	unsigned int magnitude=storage.getPatchMagnitude();
+	if (levels>magnitude)
+		levels=magnitude;
+	if (m_valid && levels==m_levels.size() && fullnessThreshold==m_fullnessThreshold && map.getDelta()==m_delta){
+		follow(map);
+		build(map, storage.getActiveArea());
+		return;
+	}
+
+	//(re)build the levels over all the allocated patches of the map
+	m_levels.clear();
+	for (unsigned int l=1; l<=levels; l++)
+		m_levels.push_back(Level(map.getMapSizeX()>>l, map.getMapSizeY()>>l, magnitude-l));
+	m_origin=map.map2world(0,0);
+	m_delta=map.getDelta();
+	m_fullnessThreshold=fullnessThreshold;
+	m_valid=true;
+	Level::PointList allocated;
+	for (int x=0; x<storage.getXSize(); x++)
+		for (int y=0; y<storage.getYSize(); y++)
+			if (storage.m_cells[x][y])
+				allocated.push_back(IntPoint(x,y));
+	build(map, allocated);
+}
+
+void MapPyramid::follow(const ScanMatcherMap& map){
+	if (!m_valid)
+		return;
+	//the map grows by whole patches, and so do the levels
+	const HierarchicalArray2D<ScanMatcherCell>& storage=map.storage();
+	double patchWorldSize=m_delta*(1<<storage.getPatchMagnitude());
+	Point origin=map.map2world(0,0);
+	int dx=(int)round((origin.x-m_origin.x)/patchWorldSize);
+	int dy=(int)round((origin.y-m_origin.y)/patchWorldSize);
+	for (unsigned int l=0; l<m_levels.size(); l++)
+		if (dx || dy || m_levels[l].getXSize()!=storage.getXSize() || m_levels[l].getYSize()!=storage.getYSize())
+			m_levels[l].resize(dx, dy, dx+storage.getXSize(), dy+storage.getYSize());
+	m_origin=origin;
+}
+
+void MapPyramid::build(const ScanMatcherMap& map, const Level::PointList& patches){
+	typedef Level::PointList PointList;
+	int magnitude=map.storage().getPatchMagnitude();
+
+	//each level is pooled from the one below, patch by patch: a patch only depends on the same patch of the finer level
+	for (unsigned int l=1; l<=m_levels.size(); l++){
+		Level& level=m_levels[l-1];
+		const Level* finer=l>1?&m_levels[l-2]:0;
+		int size=1<<(magnitude-l);
+		for (PointList::const_iterator it=patches.begin(); it!=patches.end(); ++it){
+			if (!level.isInside(*it))
+				continue;
+			ContiguousArray2D<float>& patch=level.writablePatch(*it);
+			int x0=it->x*size, y0=it->y*size;
+			for (int x=0; x<size; x++)
+				for (int y=0; y<size; y++){
+					float v=0;
+					for (int i=0; i<2; i++)
+						for (int j=0; j<2; j++){
+							IntPoint c(2*(x0+x)+i, 2*(y0+y)+j);
+							float w;
+							if (finer)
+								w=finer->cell(c);
+							else {
+								double occupancy=map.cell(c);
+								w=occupancy>m_fullnessThreshold?(float)occupancy:0.f;
+							}
+							v=w>v?w:v;
+						}
+					patch.cell(x,y)=v;
+				}
+		}
+	}
+}
+
+};
@@ -1,11 +1,11 @@
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
-#include <log/carmenconfiguration.h>
-#include <log/sensorlog.h>
+#include <gmapping/log/carmenconfiguration.h>
+#include <gmapping/log/sensorlog.h>
 #include <unistd.h>
 #include <utils/commandline.h>
-#include <log/sensorstream.h>
+#include <gmapping/log/sensorstream.h>
 #include "scanmatcherprocessor.h"
 
 using namespace std;
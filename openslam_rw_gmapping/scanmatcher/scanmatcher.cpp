@@ -1,6 +1,8 @@
 #include <cstring>
 #include <limits>
 #include <list>
+#include <vector>
+#include <algorithm>
 #include <iostream>
 
 #include <gmapping/scanmatcher/scanmatcher.h>
@@ -30,6 +32,8 @@ ScanMatcher::ScanMatcher(): m_laserPose(0,0,0){
 	m_linearOdometryReliability=0.;
 	m_freeCellRatio=sqrt(2.);
 	m_initialBeamsSkip=0;
+	m_correlativeLinearWindow=0.5;
+	m_correlativeAngularWindow=0.35;
 	
 /*	
 	// This  are the dafault settings for a grid map of 10 cm
@@ -46,12 +50,9 @@ ScanMatcher::ScanMatcher(): m_laserPose(0,0,0){
 	m_lasamplestep=0.01;
 	m_generateMap=false;
 */
-
-   m_linePoints = new IntPoint[20000];
 }
 
 ScanMatcher::~ScanMatcher(){
-	delete [] m_linePoints;
 }
 
 void ScanMatcher::invalidateActiveArea(){
@@ -62,7 +63,7 @@ void ScanMatcher::invalidateActiveArea(){
 void ScanMatcher::computeActiveArea(ScanMatcherMap& map, const OrientedPoint& p, const double* readings){
 	if (m_activeAreaComputed)
 		return;
-	HierarchicalArray2D<PointAccumulator>::PointSet activeArea;
+	HierarchicalArray2D<ScanMatcherCell>::PointSet activeArea;
 	OrientedPoint lp=p;
 	lp.x+=cos(p.theta)*m_laserPose.x-sin(p.theta)*m_laserPose.y;
 	lp.y+=sin(p.theta)*m_laserPose.x+cos(p.theta)*m_laserPose.y;
@@ -113,15 +114,45 @@ void ScanMatcher::computeActiveArea(ScanMatcherMap& map, const OrientedPoint& p,
 	m_activeAreaComputed=true;
 }
 */
-void ScanMatcher::computeActiveArea(ScanMatcherMap& map, const OrientedPoint& p, const double* readings){
-	if (m_activeAreaComputed)
-		return;
-	OrientedPoint lp=p;
-	lp.x+=cos(p.theta)*m_laserPose.x-sin(p.theta)*m_laserPose.y;
-	lp.y+=sin(p.theta)*m_laserPose.x+cos(p.theta)*m_laserPose.y;
-	lp.theta+=m_laserPose.theta;
-	IntPoint p0=map.world2map(lp);
-	
+/**adds a patch to an active area being collected. Consecutive cells of a beam mostly fall in
+the same patch, so only the repetitions of the last patch are dropped here, the list is made
+unique once all the beams are done.*/
+static inline void addPatch(HierarchicalArray2D<ScanMatcherCell>::PointList& area, const IntPoint& p){
+	if (area.empty() || area.back().x!=p.x || area.back().y!=p.y)
+		area.push_back(p);
+}
+
+/**collects the patches of the cells traversed by the beams*/
+struct ActiveAreaVisitor{
+	ActiveAreaVisitor(const ScanMatcherMap& _map, HierarchicalArray2D<ScanMatcherCell>::PointList& _area):
+		map(_map), area(_area){}
+	inline void operator()(const IntPoint& p){
+		assert(map.isInside(p));
+		assert(p.x>=0 && p.y>=0);
+		addPatch(area, map.storage().patchIndexes(p));
+	}
+	const ScanMatcherMap& map;
+	HierarchicalArray2D<ScanMatcherCell>::PointList& area;
+};
+
+/**marks as free the cells traversed by the beams, summing up the change of their entropy*/
+struct FreeCellVisitor{
+	FreeCellVisitor(ScanMatcherMap& _map): map(_map), esum(0){}
+	inline void operator()(const IntPoint& p){
+		ScanMatcherCell& cell=map.cell(p);
+		double e=-cell.entropy();
+		cell.update(false, Point(0,0));
+		e+=cell.entropy();
+		esum+=e;
+	}
+	ScanMatcherMap& map;
+	double esum;
+};
+
+/**grows the map, if needed, so that it contains the laser pose and the endpoints of the beams,
+truncated to the usable range*/
+void ScanMatcher::enlargeMap(ScanMatcherMap& map, const OrientedPoint& lp, const double* dirX, const double* dirY, const double* readings) const{
+	/*determine the size of the area*/
 	Point min(map.map2world(0,0));
 	Point max(map.map2world(map.getMapSizeX()-1,map.getMapSizeY()-1));
 	       
@@ -130,14 +161,13 @@ void ScanMatcher::computeActiveArea(ScanMatcherMap& map, const OrientedPoint& p,
 	if (lp.x>max.x) max.x=lp.x;
 	if (lp.y>max.y) max.y=lp.y;
 	
-	/*determine the size of the area*/
-	const double * angle=m_laserAngles+m_initialBeamsSkip;
-	for (const double* r=readings+m_initialBeamsSkip; r<readings+m_laserBeams; r++, angle++){
+	const double * dx=dirX+m_initialBeamsSkip, * dy=dirY+m_initialBeamsSkip;
+	for (const double* r=readings+m_initialBeamsSkip; r<readings+m_laserBeams; r++, dx++, dy++){
 		if (*r>m_laserMaxRange||*r==0.0||isnan(*r)) continue;
 		double d=*r>m_usableRange?m_usableRange:*r;
 		Point phit=lp;
-		phit.x+=d*cos(lp.theta+*angle);
-		phit.y+=d*sin(lp.theta+*angle);
+		phit.x+=d**dx;
+		phit.y+=d**dy;
 		if (phit.x<min.x) min.x=phit.x;
 		if (phit.y<min.y) min.y=phit.y;
 		if (phit.x>max.x) max.x=phit.x;
@@ -158,52 +188,58 @@ void ScanMatcher::computeActiveArea(ScanMatcherMap& map, const OrientedPoint& p,
 		map.resize(min.x, min.y, max.x, max.y);
 		//cerr << "RESIZE " << min.x << " " << min.y << " " << max.x << " " << max.y << endl;
 	}
+}
+
+void ScanMatcher::computeActiveArea(ScanMatcherMap& map, const OrientedPoint& p, const double* readings){
+	if (m_activeAreaComputed)
+		return;
+	OrientedPoint lp=p;
+	lp.x+=cos(p.theta)*m_laserPose.x-sin(p.theta)*m_laserPose.y;
+	lp.y+=sin(p.theta)*m_laserPose.x+cos(p.theta)*m_laserPose.y;
+	lp.theta+=m_laserPose.theta;
+	double dirX[LASER_MAXBEAMS], dirY[LASER_MAXBEAMS];
+	beamDirections(dirX, dirY, p.theta);
+	enlargeMap(map, lp, dirX, dirY, readings);
 	
-	HierarchicalArray2D<PointAccumulator>::PointSet activeArea;
+	HierarchicalArray2D<ScanMatcherCell>::PointList& activeArea=m_activeArea;
+	activeArea.clear();
+	ActiveAreaVisitor visitor(map, activeArea);
 	/*allocate the active area*/
-	angle=m_laserAngles+m_initialBeamsSkip;
-	for (const double* r=readings+m_initialBeamsSkip; r<readings+m_laserBeams; r++, angle++)
+	const double * dx=dirX+m_initialBeamsSkip, * dy=dirY+m_initialBeamsSkip;
+	for (const double* r=readings+m_initialBeamsSkip; r<readings+m_laserBeams; r++, dx++, dy++)
 		if (m_generateMap){
 			double d=*r;
 			if (d>m_laserMaxRange||d==0.0||isnan(d))
 				continue;
 			if (d>m_usableRange)
 				d=m_usableRange;
-			Point phit=lp+Point(d*cos(lp.theta+*angle),d*sin(lp.theta+*angle));
+			Point phit=lp+Point(d**dx,d**dy);
 			IntPoint p0=map.world2map(lp);
 			IntPoint p1=map.world2map(phit);
-			
-			//IntPoint linePoints[20000] ;
-			GridLineTraversalLine line;
-			line.points=m_linePoints;
-			GridLineTraversal::gridLine(p0, p1, &line);
-			for (int i=0; i<line.num_points-1; i++){
-				assert(map.isInside(m_linePoints[i]));
-				activeArea.insert(map.storage().patchIndexes(m_linePoints[i]));
-				assert(m_linePoints[i].x>=0 && m_linePoints[i].y>=0);
-			}
+			GridLineTraversal::visitLine(p0, p1, visitor, false);
 			if (d<m_usableRange){
 				IntPoint cp=map.storage().patchIndexes(p1);
 				assert(cp.x>=0 && cp.y>=0);
-				activeArea.insert(cp);
+				addPatch(activeArea, cp);
 			}
 		} else {
 			if (*r>m_laserMaxRange||*r>m_usableRange||*r==0.0||isnan(*r)) continue;
 			Point phit=lp;
-			phit.x+=*r*cos(lp.theta+*angle);
-			phit.y+=*r*sin(lp.theta+*angle);
+			phit.x+=*r**dx;
+			phit.y+=*r**dy;
 			IntPoint p1=map.world2map(phit);
 			assert(p1.x>=0 && p1.y>=0);
 			IntPoint cp=map.storage().patchIndexes(p1);
 			assert(cp.x>=0 && cp.y>=0);
-			activeArea.insert(cp);
+			addPatch(activeArea, cp);
 		}
+	HierarchicalArray2D<ScanMatcherCell>::makeUnique(activeArea);
 	
 	//this allocates the unallocated cells in the active area of the map
 	//cout << "activeArea::size() " << activeArea.size() << endl;
 /*	
 	cerr << "ActiveArea=";
-	for (HierarchicalArray2D<PointAccumulator>::PointSet::const_iterator it=activeArea.begin(); it!= activeArea.end(); it++){
+	for (HierarchicalArray2D<ScanMatcherCell>::PointList::const_iterator it=activeArea.begin(); it!= activeArea.end(); it++){
 		cerr << "(" << it->x <<"," << it->y << ") ";
 	}
 	cerr << endl;
@@ -212,61 +248,145 @@ void ScanMatcher::computeActiveArea(ScanMatcherMap& map, const OrientedPoint& p,
 	m_activeAreaComputed=true;
 }
 
+void ScanMatcher::updateLikelihoodField(LikelihoodField& field, const ScanMatcherMap& map) const{
+	field.update(map, m_kernelSize, m_fullnessThreshold);
+}
+
+void ScanMatcher::updateMapPyramid(MapPyramid& pyramid, const ScanMatcherMap& map, unsigned int levels) const{
+	pyramid.update(map, levels, m_fullnessThreshold);
+}
+
 double ScanMatcher::registerScan(ScanMatcherMap& map, const OrientedPoint& p, const double* readings){
 	if (!m_activeAreaComputed)
 		computeActiveArea(map, p, readings);
 		
 	//this operation replicates the cells that will be changed in the registration operation
 	map.storage().allocActiveArea();
+	map.storage().addDirtyArea(map.storage().getActiveArea());
 	
 	OrientedPoint lp=p;
 	lp.x+=cos(p.theta)*m_laserPose.x-sin(p.theta)*m_laserPose.y;
 	lp.y+=sin(p.theta)*m_laserPose.x+cos(p.theta)*m_laserPose.y;
 	lp.theta+=m_laserPose.theta;
 	IntPoint p0=map.world2map(lp);
+	double dirX[LASER_MAXBEAMS], dirY[LASER_MAXBEAMS];
+	beamDirections(dirX, dirY, p.theta);
 	
 	
-	const double * angle=m_laserAngles+m_initialBeamsSkip;
-	double esum=0;
-	for (const double* r=readings+m_initialBeamsSkip; r<readings+m_laserBeams; r++, angle++)
+	const double * dx=dirX+m_initialBeamsSkip, * dy=dirY+m_initialBeamsSkip;
+	FreeCellVisitor freeCells(map);
+	double& esum=freeCells.esum;
+	for (const double* r=readings+m_initialBeamsSkip; r<readings+m_laserBeams; r++, dx++, dy++)
 		if (m_generateMap){
 			double d=*r;
 			if (d>m_laserMaxRange||d==0.0||isnan(d))
 				continue;
 			if (d>m_usableRange)
 				d=m_usableRange;
-			Point phit=lp+Point(d*cos(lp.theta+*angle),d*sin(lp.theta+*angle));
+			Point phit=lp+Point(d**dx,d**dy);
 			IntPoint p1=map.world2map(phit);
-			//IntPoint linePoints[20000] ;
-			GridLineTraversalLine line;
-			line.points=m_linePoints;
-			GridLineTraversal::gridLine(p0, p1, &line);
-			for (int i=0; i<line.num_points-1; i++){
-				PointAccumulator& cell=map.cell(line.points[i]);
-				double e=-cell.entropy();
-				cell.update(false, Point(0,0));
-				e+=cell.entropy();
-				esum+=e;
-			}
+			GridLineTraversal::visitLine(p0, p1, freeCells, false);
 			if (d<m_usableRange){
 				double e=-map.cell(p1).entropy();
-				map.cell(p1).update(true, phit);
+				map.cell(p1).update(true, phit, map.map2world(p1), map.getDelta());
 				e+=map.cell(p1).entropy();
 				esum+=e;
 			}
 		} else {
 			if (*r>m_laserMaxRange||*r>m_usableRange||*r==0.0||isnan(*r)) continue;
 			Point phit=lp;
-			phit.x+=*r*cos(lp.theta+*angle);
-			phit.y+=*r*sin(lp.theta+*angle);
+			phit.x+=*r**dx;
+			phit.y+=*r**dy;
 			IntPoint p1=map.world2map(phit);
 			assert(p1.x>=0 && p1.y>=0);
-			map.cell(p1).update(true,phit);
+			map.cell(p1).update(true, phit, map.map2world(p1), map.getDelta());
 		}
 	//cout  << "informationGain=" << -esum << endl;
 	return esum;
 }
 
+/**gives access to the cells written by a scan, detaching their patches on the first write.
+Consecutive cells of a beam mostly fall in the same patch, which is kept at hand.
+As a line visitor it marks the cells as free, summing up the change of their entropy if requested.*/
+class ScanWriter{
+	public:
+		typedef HierarchicalArray2D<ScanMatcherCell> Storage;
+		ScanWriter(ScanMatcherMap& map, Storage::PointList& area, bool computeEntropy):
+			esum(0), m_map(map), m_storage(map.storage()), m_area(area), m_magnitude(m_storage.getPatchMagnitude()), m_patch(0), m_computeEntropy(computeEntropy){}
+		inline void operator()(const IntPoint& p){
+			update(p, false, Point(0,0));
+		}
+		inline void update(const IntPoint& p, bool occupied, const Point& hit){
+			ScanMatcherCell& c=cell(p);
+			Point center=occupied?m_map.map2world(p):Point(0,0);
+			if (m_computeEntropy){
+				double e=-c.entropy();
+				c.update(occupied, hit, center, m_map.getDelta());
+				esum+=e+c.entropy();
+			} else
+				c.update(occupied, hit, center, m_map.getDelta());
+		}
+		inline ScanMatcherCell& cell(const IntPoint& p){
+			IntPoint c=m_storage.patchIndexes(p);
+			if (!m_patch || c.x!=m_current.x || c.y!=m_current.y){
+				m_patch=&m_storage.writablePatch(c);
+				m_current=c;
+				addPatch(m_area, c);
+			}
+			return m_patch->cell(p.x-(c.x<<m_magnitude), p.y-(c.y<<m_magnitude));
+		}
+		double esum;
+	protected:
+		const ScanMatcherMap& m_map;
+		Storage& m_storage;
+		Storage::PointList& m_area;
+		int m_magnitude;
+		Storage::Patch* m_patch;
+		IntPoint m_current;
+		bool m_computeEntropy;
+};
+
+double ScanMatcher::registerScanSinglePass(ScanMatcherMap& map, const OrientedPoint& p, const double* readings, bool computeEntropy){
+	OrientedPoint lp=p;
+	lp.x+=cos(p.theta)*m_laserPose.x-sin(p.theta)*m_laserPose.y;
+	lp.y+=sin(p.theta)*m_laserPose.x+cos(p.theta)*m_laserPose.y;
+	lp.theta+=m_laserPose.theta;
+	double dirX[LASER_MAXBEAMS], dirY[LASER_MAXBEAMS];
+	beamDirections(dirX, dirY, p.theta);
+	enlargeMap(map, lp, dirX, dirY, readings);
+	IntPoint p0=map.world2map(lp);
+	
+	m_activeArea.clear();
+	ScanWriter writer(map, m_activeArea, computeEntropy);
+	const double * dx=dirX+m_initialBeamsSkip, * dy=dirY+m_initialBeamsSkip;
+	for (const double* r=readings+m_initialBeamsSkip; r<readings+m_laserBeams; r++, dx++, dy++)
+		if (m_generateMap){
+			double d=*r;
+			if (d>m_laserMaxRange||d==0.0||isnan(d))
+				continue;
+			if (d>m_usableRange)
+				d=m_usableRange;
+			Point phit=lp+Point(d**dx,d**dy);
+			IntPoint p1=map.world2map(phit);
+			GridLineTraversal::visitLine(p0, p1, writer, false);
+			if (d<m_usableRange)
+				writer.update(p1, true, phit);
+		} else {
+			if (*r>m_laserMaxRange||*r>m_usableRange||*r==0.0||isnan(*r)) continue;
+			Point phit=lp;
+			phit.x+=*r**dx;
+			phit.y+=*r**dy;
+			IntPoint p1=map.world2map(phit);
+			assert(p1.x>=0 && p1.y>=0);
+			writer.cell(p1).update(true, phit, map.map2world(p1), map.getDelta());
+		}
+	HierarchicalArray2D<ScanMatcherCell>::makeUnique(m_activeArea);
+	map.storage().setActiveArea(m_activeArea, true);
+	map.storage().addDirtyArea(m_activeArea);
+	m_activeAreaComputed=true;
+	return writer.esum;
+}
+
 /*
 void ScanMatcher::registerScan(ScanMatcherMap& map, const OrientedPoint& p, const double* readings){
 	if (!m_activeAreaComputed)
@@ -334,11 +454,67 @@ double ScanMatcher::icpOptimize(OrientedPoint& pnew, const ScanMatcherMap& map,
 	return currentScore;
 }
 
-double ScanMatcher::optimize(OrientedPoint& pnew, const ScanMatcherMap& map, const OrientedPoint& init, const double* readings) const{
+OrientedPoint ScanMatcher::coarseOptimize(const MapPyramid& pyramid, const ScanMatcherMap& map, const OrientedPoint& init, const double* readings) const{
+	//the moves of optimize(), in the same order
+	static const int moves[6][3]={{1,0,0}, {-1,0,0}, {0,-1,0}, {0,1,0}, {0,0,1}, {0,0,-1}};
+	double dirX[LASER_MAXBEAMS], dirY[LASER_MAXBEAMS];
+	double turnedX[LASER_MAXBEAMS], turnedY[LASER_MAXBEAMS];
+	OrientedPoint currentPose=init;
+	for (unsigned int level=pyramid.getLevels(); level>0; level--){
+		double ldelta=map.getDelta()*(1<<level);
+		//a turn moving the farthest endpoints by about one cell of the level
+		double adelta=ldelta/m_usableRange;
+		beamDirections(dirX, dirY, currentPose.theta);
+		double currentScore=odometryGain(init, currentPose)*coarseScore(pyramid, level, map, currentPose, readings, dirX, dirY);
+		bool improved=true;
+		while (improved){
+			improved=false;
+			OrientedPoint bestLocalPose=currentPose;
+			double bestLocalScore=currentScore;
+			for (int m=0; m<6; m++){
+				OrientedPoint localPose=currentPose;
+				localPose.x+=moves[m][0]*ldelta;
+				localPose.y+=moves[m][1]*ldelta;
+				localPose.theta+=moves[m][2]*adelta;
+				double localScore;
+				if (moves[m][2]){
+					beamDirections(turnedX, turnedY, localPose.theta);
+					localScore=coarseScore(pyramid, level, map, localPose, readings, turnedX, turnedY);
+				} else
+					localScore=coarseScore(pyramid, level, map, localPose, readings, dirX, dirY);
+				localScore*=odometryGain(init, localPose);
+				if (localScore>bestLocalScore){
+					bestLocalScore=localScore;
+					bestLocalPose=localPose;
+				}
+			}
+			if (bestLocalScore>currentScore){
+				if (bestLocalPose.theta!=currentPose.theta)
+					beamDirections(dirX, dirY, bestLocalPose.theta);
+				currentPose=bestLocalPose;
+				currentScore=bestLocalScore;
+				improved=true;
+			}
+		}
+	}
+	return currentPose;
+}
+
+double ScanMatcher::optimize(OrientedPoint& pnew, const ScanMatcherMap& map, const OrientedPoint& init, const double* readings, const LikelihoodField* field, const MapPyramid* pyramid) const{
 	double bestScore=-1;
 	OrientedPoint currentPose=init;
-	double currentScore=score(map, currentPose, readings);
+	double currentScore=score(map, currentPose, readings, field);
+	if (pyramid && pyramid->getLevels()){
+		//the coarse pose is kept only if it is better on the map itself
+		OrientedPoint coarsePose=coarseOptimize(*pyramid, map, init, readings);
+		double coarseScore=score(map, coarsePose, readings, field);
+		if (coarseScore>currentScore){
+			currentPose=coarsePose;
+			currentScore=coarseScore;
+		}
+	}
 	double adelta=m_optAngularDelta, ldelta=m_optLinearDelta;
+	double dirX[LASER_MAXBEAMS], dirY[LASER_MAXBEAMS];
 	unsigned int refinement=0;
 	enum Move{Front, Back, Left, Right, TurnLeft, TurnRight, Done};
 /*	cout << __PRETTY_FUNCTION__<<  " readings: ";
@@ -358,6 +534,8 @@ double ScanMatcher::optimize(OrientedPoint& pnew, const ScanMatcherMap& map, con
 //		cout <<  "pose=" << currentPose.x  << " " << currentPose.y << " " << currentPose.theta << endl;
 		OrientedPoint bestLocalPose=currentPose;
 		OrientedPoint localPose=currentPose;
+		//the translational moves share the beam directions of the current pose
+		beamDirections(dirX, dirY, currentPose.theta);
 
 		Move move=Front;
 		do {
@@ -390,18 +568,10 @@ double ScanMatcher::optimize(OrientedPoint& pnew, const ScanMatcherMap& map, con
 				default:;
 			}
 			
-			double odo_gain=1;
-			if (m_angularOdometryReliability>0.){
-				double dth=init.theta-localPose.theta; 	dth=atan2(sin(dth), cos(dth)); 	dth*=dth;
-				odo_gain*=exp(-m_angularOdometryReliability*dth);
-			}
-			if (m_linearOdometryReliability>0.){
-				double dx=init.x-localPose.x;
-				double dy=init.y-localPose.y;
-				double drho=dx*dx+dy*dy;
-				odo_gain*=exp(-m_linearOdometryReliability*drho);
-			}
-			double localScore=odo_gain*score(map, localPose, readings);
+			double odo_gain=odometryGain(init, localPose);
+			bool turned=localPose.theta!=currentPose.theta;
+			double localScore=odo_gain*(turned ?
+				score(map, localPose, readings, field) : score(map, localPose, readings, dirX, dirY, field));
 			
 			if (localScore>currentScore){
 				currentScore=localScore;
@@ -419,6 +589,153 @@ double ScanMatcher::optimize(OrientedPoint& pnew, const ScanMatcherMap& map, con
 	return bestScore;
 }
 
+/**a node of the branch and bound search: the translations [x, x+2^height) x [y, y+2^height),
+in cells, at the given angle, and an upper bound of their scores*/
+struct SearchNode{
+	int angle, x, y, height;
+	double bound;
+	inline bool operator<(const SearchNode& n) const {return bound<n.bound;}
+};
+
+/**@returns the score of the endpoints, in cells, translated by (x,y): the occupancy of the cells hit*/
+static double leafScore(const ScanMatcherMap& map, const IntPoint* endpoints, unsigned int n, int x, int y, double threshold){
+	double s=0;
+	for (unsigned int i=0; i<n; i++){
+		double v=map.cell(IntPoint(endpoints[i].x+x, endpoints[i].y+y));
+		s+=v>threshold?v:0;
+	}
+	return s;
+}
+
+/**@returns a bound of the scores of the endpoints translated by the offsets of a node of the given height.
+The endpoint of a beam spans 2^height cells per axis, so it lies in at most 2x2 cells of the level of
+that height, whose highest value bounds the one of any cell it can hit.*/
+static double nodeBound(const MapPyramid& pyramid, const IntPoint* endpoints, unsigned int n, int x, int y, int height){
+	double s=0;
+	int span=(1<<height)-1;
+	for (unsigned int i=0; i<n; i++){
+		int x1=endpoints[i].x+x, y1=endpoints[i].y+y;
+		float v=pyramid.value(height, IntPoint(x1, y1));
+		float w=pyramid.value(height, IntPoint(x1+span, y1));
+		v=w>v?w:v;
+		w=pyramid.value(height, IntPoint(x1, y1+span));
+		v=w>v?w:v;
+		w=pyramid.value(height, IntPoint(x1+span, y1+span));
+		s+=w>v?w:v;
+	}
+	return s;
+}
+
+OrientedPoint ScanMatcher::branchAndBound(const MapPyramid& pyramid, const ScanMatcherMap& map, const OrientedPoint& init, const double* readings) const{
+	//the beams used by score()
+	unsigned int beams[LASER_MAXBEAMS];
+	unsigned int n=0;
+	double maxRange=0;
+	unsigned int skip=0;
+	for (unsigned int i=m_initialBeamsSkip; i<m_laserBeams; i++){
+		const double* r=readings+i;
+		skip++;
+		skip=skip>m_likelihoodSkip?0:skip;
+		if (skip||*r>m_usableRange||*r==0.0) continue;
+		beams[n++]=i;
+		maxRange=*r>maxRange?*r:maxRange;
+	}
+	double delta=map.getDelta();
+	if (!n || maxRange<delta)
+		return init;
+	double astep=acos(1.-delta*delta/(2.*maxRange*maxRange));
+	int angles=(int)ceil(m_correlativeAngularWindow/astep);
+	int window=(int)ceil(m_correlativeLinearWindow/delta);
+	
+	//the endpoints at each angle of the window, in cells, before translating the pose
+	std::vector<IntPoint> endpoints((2*angles+1)*n);
+	double dirX[LASER_MAXBEAMS], dirY[LASER_MAXBEAMS];
+	double hitX[LASER_MAXBEAMS], hitY[LASER_MAXBEAMS];
+	for (int a=-angles; a<=angles; a++){
+		OrientedPoint p=init;
+		p.theta+=a*astep;
+		OrientedPoint lp=p;
+		lp.x+=cos(p.theta)*m_laserPose.x-sin(p.theta)*m_laserPose.y;
+		lp.y+=sin(p.theta)*m_laserPose.x+cos(p.theta)*m_laserPose.y;
+		beamDirections(dirX, dirY, p.theta);
+		projectBeams(hitX, hitY, dirX, dirY, readings, m_laserBeams, lp.x, lp.y);
+		IntPoint* e=&endpoints[(a+angles)*n];
+		for (unsigned int i=0; i<n; i++)
+			e[i]=map.world2map(Point(hitX[beams[i]], hitY[beams[i]]));
+	}
+	
+	//the pose given has to be beaten
+	SearchNode best;
+	best.angle=angles;
+	best.x=best.y=best.height=0;
+	best.bound=leafScore(map, &endpoints[angles*n], n, 0, 0, m_fullnessThreshold);
+	
+	//the roots tile the window on the coarsest level not larger than it, the most promising is expanded first
+	int height=pyramid.getLevels();
+	while (height>1 && (1<<height)>2*window+1)
+		height--;
+	std::vector<SearchNode> stack;
+	for (int a=0; a<=2*angles; a++)
+		for (int x=-window; x<=window; x+=1<<height)
+			for (int y=-window; y<=window; y+=1<<height){
+				SearchNode node;
+				node.angle=a;
+				node.x=x;
+				node.y=y;
+				node.height=height;
+				node.bound=nodeBound(pyramid, &endpoints[a*n], n, x, y, height);
+				if (node.bound>best.bound)
+					stack.push_back(node);
+			}
+	std::sort(stack.begin(), stack.end());
+	while (!stack.empty()){
+		SearchNode node=stack.back();
+		stack.pop_back();
+		if (node.bound<=best.bound)
+			continue;
+		if (!node.height){
+			best=node;
+			continue;
+		}
+		SearchNode children[4];
+		int c=0;
+		int half=1<<(node.height-1);
+		for (int dx=0; dx<=half; dx+=half)
+			for (int dy=0; dy<=half; dy+=half){
+				SearchNode& child=children[c];
+				child.angle=node.angle;
+				child.x=node.x+dx;
+				child.y=node.y+dy;
+				child.height=node.height-1;
+				if (child.x>window || child.y>window)
+					continue;
+				const IntPoint* e=&endpoints[child.angle*n];
+				child.bound=child.height?
+					nodeBound(pyramid, e, n, child.x, child.y, child.height):
+					leafScore(map, e, n, child.x, child.y, m_fullnessThreshold);
+				if (child.bound>best.bound)
+					c++;
+			}
+		//at most four children, an insertion sort leaves the best one on top of the stack
+		for (int i=1; i<c; i++)
+			for (int j=i; j>0 && children[j]<children[j-1]; j--)
+				std::swap(children[j], children[j-1]);
+		for (int i=0; i<c; i++)
+			stack.push_back(children[i]);
+	}
+	
+	OrientedPoint pose=init;
+	pose.x+=best.x*delta;
+	pose.y+=best.y*delta;
+	pose.theta+=(best.angle-angles)*astep;
+	return pose;
+}
+
+double ScanMatcher::correlativeOptimize(OrientedPoint& pnew, const ScanMatcherMap& map, const OrientedPoint& init, const double* readings, const MapPyramid& pyramid, const LikelihoodField* field) const{
+	OrientedPoint start=pyramid.getLevels()?branchAndBound(pyramid, map, init, readings):init;
+	return optimize(pnew, map, start, readings, field);
+}
+
 struct ScoredMove{
 	OrientedPoint pose;
 	double score;
@@ -565,6 +882,10 @@ void ScanMatcher::setLaserParameters
 	m_laserBeams=beams;
 	//m_laserAngles=new double[beams];
 	memcpy(m_laserAngles, angles, sizeof(double)*m_laserBeams);	
+	for (unsigned int i=0; i<m_laserBeams; i++){
+		m_laserDirX[i]=cos(m_laserAngles[i]);
+		m_laserDirY[i]=sin(m_laserAngles[i]);
+	}
 }
 	
 
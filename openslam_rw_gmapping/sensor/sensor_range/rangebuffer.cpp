@@ -0,0 +1,49 @@
+#include <assert.h>
+#include <gmapping/sensor/sensor_range/rangebuffer.h>
+
+namespace GMapping{
+
+using namespace std;
+
+RangeBuffer::RangeBuffer(unsigned int size, Encoding encoding, double resolution){
+	init(size, encoding, resolution);
+}
+
+RangeBuffer::RangeBuffer(const double* ranges, unsigned int size, Encoding encoding, double resolution){
+	init(size, encoding, resolution);
+	for (unsigned int i=0; i<size; i++)
+		set(i, ranges[i]);
+}
+
+void RangeBuffer::init(unsigned int size, Encoding encoding, double resolution){
+	assert(resolution>0);
+	m_encoding=encoding;
+	m_resolution=resolution;
+	m_size=size;
+	if (m_encoding==Float)
+		m_floats.resize(size);
+	else
+		m_codes.resize(size);
+}
+
+void RangeBuffer::decode(double* ranges) const{
+	if (m_encoding==Float){
+		for (unsigned int i=0; i<m_size; i++)
+			ranges[i]=m_floats[i];
+		return;
+	}
+	for (unsigned int i=0; i<m_size; i++)
+		ranges[i]=(*this)[i];
+}
+
+void RangeBuffer::clear(){
+	m_size=0;
+	vector<float>().swap(m_floats);
+	vector<unsigned short>().swap(m_codes);
+}
+
+size_t RangeBuffer::bytes() const{
+	return sizeof(RangeBuffer)+m_floats.capacity()*sizeof(float)+m_codes.capacity()*sizeof(unsigned short);
+}
+
+};
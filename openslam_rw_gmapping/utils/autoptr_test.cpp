@@ -5,6 +5,7 @@ using namespace std;
 using namespace GMapping;
 
 typedef autoptr<double> DoubleAutoPtr;
+typedef atomic_autoptr<double> DoubleAtomicAutoPtr;
 
 int main(int argc, const char * const * argv){
 	double* d1=new double(10.);
@@ -26,4 +27,14 @@ int main(int argc, const char * const * argv){
 	cout << "neg conversion operator " << nullPtr << endl;
 	cout << "conversion operator " << (int)pd1 << endl;
 	cout << "neg conversion operator " << !(pd1) << endl;
+	cout << "atomic construction and assignment" << endl;
+	DoubleAtomicAutoPtr pa1(new double(30.));
+	DoubleAtomicAutoPtr pa2(pa1);
+	DoubleAtomicAutoPtr pa3;
+	pa3=pa2;
+	cout << *pa1 << " " << *pa2 << " " << *pa3 << " shares " << pa1.m_reference->shares << endl;
+	cout << "atomic swap" << endl;
+	DoubleAtomicAutoPtr pa4;
+	pa4.swap(pa3);
+	cout << *pa4 << " " << !(pa3) << " shares " << pa1.m_reference->shares << endl;
 }
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <new>
+#include <gmapping/utils/slaballocator.h>
+
+namespace GMapping {
+
+SlabAllocator::SlabAllocator(size_t blockSize, unsigned int blocksPerSlab, size_t alignment){
+	if (blockSize<sizeof(FreeBlock))
+		blockSize=sizeof(FreeBlock);
+	if (alignment<sizeof(FreeBlock))
+		alignment=sizeof(FreeBlock);
+	m_blockSize=(blockSize+alignment-1)/alignment*alignment;
+	m_blocksPerSlab=blocksPerSlab?blocksPerSlab:1;
+	m_free=0;
+	m_fresh=0;
+	m_freshBlocks=0;
+	m_capacity=m_used=m_peak=0;
+	m_allocations=m_recycled=0;
+	m_lock=0;
+}
+
+SlabAllocator::~SlabAllocator(){
+	for (unsigned int i=0; i<m_slabs.size(); i++)
+		free(m_slabs[i]);
+}
+
+void SlabAllocator::grow(unsigned int blocks){
+	void* slab=0;
+	if (posix_memalign(&slab, Alignment, m_blockSize*blocks))
+		throw std::bad_alloc();
+	m_slabs.push_back(static_cast<char*>(slab));
+	//the blocks left in the previous slab go to the free list
+	for (; m_freshBlocks; m_freshBlocks--, m_fresh+=m_blockSize){
+		FreeBlock* b=reinterpret_cast<FreeBlock*>(m_fresh);
+		b->next=m_free;
+		m_free=b;
+	}
+	m_fresh=static_cast<char*>(slab);
+	m_freshBlocks=blocks;
+	m_capacity+=blocks;
+}
+
+void* SlabAllocator::allocate(){
+	lock();
+	void* block=0;
+	if (m_free){
+		block=m_free;
+		m_free=m_free->next;
+		m_recycled++;
+	} else {
+		if (!m_freshBlocks){
+			try{
+				grow(m_blocksPerSlab);
+			} catch (...){
+				unlock();
+				throw;
+			}
+		}
+		block=m_fresh;
+		m_fresh+=m_blockSize;
+		m_freshBlocks--;
+	}
+	m_allocations++;
+	if (++m_used>m_peak)
+		m_peak=m_used;
+	unlock();
+	return block;
+}
+
+void SlabAllocator::deallocate(void* block){
+	if (!block)
+		return;
+	lock();
+	FreeBlock* b=static_cast<FreeBlock*>(block);
+	b->next=m_free;
+	m_free=b;
+	m_used--;
+	unlock();
+}
+
+void SlabAllocator::reserve(unsigned int blocks){
+	lock();
+	try{
+		if (m_capacity<blocks)
+			grow((blocks-m_capacity+m_blocksPerSlab-1)/m_blocksPerSlab*m_blocksPerSlab);
+	} catch (...){
+		unlock();
+		throw;
+	}
+	unlock();
+}
+
+void SlabAllocator::setBlocksPerSlab(unsigned int blocks){
+	lock();
+	m_blocksPerSlab=blocks?blocks:1;
+	unlock();
+}
+
+SlabAllocator::Statistics SlabAllocator::statistics() const{
+	Statistics s;
+	lock();
+	s.blockSize=m_blockSize;
+	s.blocksPerSlab=m_blocksPerSlab;
+	s.slabs=m_slabs.size();
+	s.capacity=m_capacity;
+	s.used=m_used;
+	s.peak=m_peak;
+	s.allocations=m_allocations;
+	s.recycled=m_recycled;
+	unlock();
+	return s;
+}
+
+};
@@ -45,6 +45,32 @@ double pf_ran_gaussian(double sigma)
   return(sigma * x2 * sqrt(-2.0*log(w)/w));
 }
 
+GaussianSampler::GaussianSampler(unsigned long seed){
+	this->seed(seed);
+}
+
+void GaussianSampler::seed(unsigned long seed){
+	m_state[0]=0x330e;
+	m_state[1]=seed&0xffff;
+	m_state[2]=(seed>>16)&0xffff;
+}
+
+const double* GaussianSampler::samples(unsigned int n){
+	unsigned int pairs=(n+1)/2;
+	m_samples.resize(2*pairs);
+	double* s=m_samples.empty()?0:&m_samples[0];
+	for (unsigned int i=0; i<2*pairs; i++)
+		s[i]=erand48(m_state);
+	for (unsigned int i=0; i<2*pairs; i+=2){
+		//1-u is in (0,1], so that the log is finite
+		double r=sqrt(-2.*log(1.-s[i]));
+		double a=2.*M_PI*s[i+1];
+		s[i]=r*cos(a);
+		s[i+1]=r*sin(a);
+	}
+	return s;
+}
+
 double sampleGaussian(double sigma, unsigned long int S) {
   /*
 	static gsl_rng * r = NULL;
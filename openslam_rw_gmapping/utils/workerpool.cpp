@@ -0,0 +1,128 @@
+#include <unistd.h>
+#include <gmapping/utils/workerpool.h>
+
+namespace GMapping {
+
+WorkerPool::WorkerPool(unsigned int threads){
+	m_size=1;
+	m_task=0;
+	m_count=0;
+	m_generation=0;
+	m_busy=0;
+	m_quit=false;
+	m_next=0;
+	pthread_mutex_init(&m_mutex, 0);
+	pthread_cond_init(&m_startCond, 0);
+	pthread_cond_init(&m_doneCond, 0);
+	start(threads);
+}
+
+WorkerPool::~WorkerPool(){
+	stop();
+	pthread_cond_destroy(&m_doneCond);
+	pthread_cond_destroy(&m_startCond);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+unsigned int WorkerPool::hardwareConcurrency(){
+	long n=sysconf(_SC_NPROCESSORS_ONLN);
+	return n>0?(unsigned int)n:1;
+}
+
+void WorkerPool::resize(unsigned int threads){
+	if (!threads)
+		threads=hardwareConcurrency();
+	if (threads==m_size)
+		return;
+	stop();
+	start(threads);
+}
+
+void WorkerPool::start(unsigned int threads){
+	if (!threads)
+		threads=hardwareConcurrency();
+	m_quit=false;
+	m_workers.resize(threads-1);
+	m_size=1;
+	for (unsigned int i=0; i<m_workers.size(); i++){
+		m_workers[i].pool=this;
+		m_workers[i].index=i+1;
+		m_workers[i].generation=m_generation;
+		if (pthread_create(&m_workers[i].thread, 0, threadMain, &m_workers[i])){
+			//could not spawn more threads, go on with the ones we have
+			m_workers.resize(i);
+			break;
+		}
+		m_size++;
+	}
+}
+
+void WorkerPool::stop(){
+	pthread_mutex_lock(&m_mutex);
+	m_quit=true;
+	pthread_cond_broadcast(&m_startCond);
+	pthread_mutex_unlock(&m_mutex);
+	for (unsigned int i=0; i<m_workers.size(); i++)
+		pthread_join(m_workers[i].thread, 0);
+	m_workers.clear();
+	m_size=1;
+}
+
+void* WorkerPool::threadMain(void* arg){
+	Worker* w=static_cast<Worker*>(arg);
+	WorkerPool* pool=w->pool;
+	pthread_mutex_lock(&pool->m_mutex);
+	//reading m_generation here would miss a job started before the thread got to run
+	unsigned int seen=w->generation;
+	for (;;){
+		while (!pool->m_quit && seen==pool->m_generation)
+			pthread_cond_wait(&pool->m_startCond, &pool->m_mutex);
+		if (pool->m_quit)
+			break;
+		seen=pool->m_generation;
+		pthread_mutex_unlock(&pool->m_mutex);
+		pool->work(w->index);
+		pthread_mutex_lock(&pool->m_mutex);
+		if (!--pool->m_busy)
+			pthread_cond_signal(&pool->m_doneCond);
+	}
+	pthread_mutex_unlock(&pool->m_mutex);
+	return 0;
+}
+
+void WorkerPool::work(unsigned int worker){
+	for (;;){
+		unsigned int i=__sync_fetch_and_add(&m_next, 1);
+		if (i>=m_count)
+			break;
+		m_task->run(i, worker);
+	}
+}
+
+void WorkerPool::run(Task& task, unsigned int count){
+	if (!count)
+		return;
+	if (m_size==1 || count==1){
+		for (unsigned int i=0; i<count; i++)
+			task.run(i, 0);
+		return;
+	}
+	pthread_mutex_lock(&m_mutex);
+	m_task=&task;
+	m_count=count;
+	m_next=0;
+	m_busy=m_size-1;
+	m_generation++;
+	pthread_cond_broadcast(&m_startCond);
+	pthread_mutex_unlock(&m_mutex);
+
+	work(0);
+
+	pthread_mutex_lock(&m_mutex);
+	while (m_busy)
+		pthread_cond_wait(&m_doneCond, &m_mutex);
+	m_task=0;
+	pthread_mutex_unlock(&m_mutex);
+}
+
+};